@@ -0,0 +1,186 @@
+#pragma once
+#include "graph.h"
+#include "base.h"
+#include "octotree.h"
+#include "pipeline.h"
+#include "profile.h"
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+
+template <typename Tree, size_t Dimension>
+class Accumulator
+{
+	struct Sample
+	{
+		Ray<Dimension> ray;
+		Hit<Dimension> hit;
+		bool valid;
+		bool missed;
+	};
+
+	int width, height;
+	int samples;
+	float cone;
+	std::vector<Sample> cache;
+	std::vector<Color> sum;
+	std::vector<int> count;
+	int frame;
+
+	std::vector<int> pending;
+	std::vector<Ray<Dimension>> rays;
+	std::vector<float> tmax;
+	std::vector<fPoint<Dimension>> points;
+	std::vector<IndexPoint<Dimension>> voxels;
+	std::vector<iVector<Dimension>> normals;
+	std::vector<int> materials;
+	std::vector<float> distances;
+
+	static bool Crosses(const Ray<Dimension>& ray, float tmax, const fPoint<Dimension>& lo, const fPoint<Dimension>& hi)
+	{
+		float t0 = 0, t1 = tmax;
+		for (int i = 0; i < (int)Dimension; ++i)
+		{
+			if (ray.vector[i] == 0)
+			{
+				if (ray.point[i] < lo[i] || ray.point[i] > hi[i])
+					return false;
+				continue;
+			}
+			float a = (lo[i] - ray.point[i]) / ray.vector[i];
+			float b = (hi[i] - ray.point[i]) / ray.vector[i];
+			t0 = (std::max)(t0, (std::min)(a, b));
+			t1 = (std::min)(t1, (std::max)(a, b));
+			if (t0 > t1)
+				return false;
+		}
+		return true;
+	}
+
+	static bool Contains(const IndexPoint<Dimension>& voxel, const fPoint<Dimension>& lo, const fPoint<Dimension>& hi)
+	{
+		for (int i = 0; i < (int)Dimension; ++i)
+			if (voxel[i] < lo[i] || voxel[i] >= hi[i])
+				return false;
+		return true;
+	}
+
+	static SurfaceSample Surface(const Sample& sample)
+	{
+		if (sample.missed)
+			return { 0, -1, INFINITY, { 0, 0, 0 } };
+		int normal = 0;
+		for (int i = 0; i < (int)Dimension; ++i)
+			if (sample.hit.normal[i] != 0)
+				normal = sample.hit.normal[i] * (i + 1);
+		return { normal, sample.hit.material, sample.hit.t, materialTable[sample.hit.material].color };
+	}
+
+public:
+	using Camera = std::function<Ray<Dimension>(int, int, int)>;
+
+	Accumulator(int width, int height, int samples, float cone) :
+		width(width), height(height),
+		samples(samples),
+		cone(cone),
+		cache(width * height * samples),
+		sum(width * height),
+		count(width * height),
+		frame(0),
+		pending(width),
+		rays(width),
+		tmax(width, INFINITY),
+		points(width),
+		voxels(width),
+		normals(width),
+		materials(width),
+		distances(width)
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		for (Sample& sample : cache)
+			sample.valid = false;
+		std::fill(sum.begin(), sum.end(), Color{ 0, 0, 0 });
+		std::fill(count.begin(), count.end(), 0);
+		frame = 0;
+	}
+
+	void Invalidate(const IndexPoint<Dimension>* points, int size)
+	{
+		if (size == 0)
+			return;
+		fPoint<Dimension> lo, hi;
+		for (int i = 0; i < (int)Dimension; ++i)
+		{
+			lo[i] = (float)points[0][i];
+			hi[i] = (float)points[0][i];
+		}
+		for (int p = 1; p < size; ++p)
+			for (int i = 0; i < (int)Dimension; ++i)
+			{
+				lo[i] = (std::min)(lo[i], (float)points[p][i]);
+				hi[i] = (std::max)(hi[i], (float)points[p][i]);
+			}
+		for (int i = 0; i < (int)Dimension; ++i)
+			hi[i] += 1;
+
+		for (int pixel = 0; pixel < width * height; ++pixel)
+		{
+			bool touched = false;
+			for (int s = 0; s < samples; ++s)
+			{
+				const Sample& sample = cache[pixel * samples + s];
+				if (sample.valid && (Crosses(sample.ray, sample.missed ? INFINITY : sample.hit.t, lo, hi)
+					|| !sample.missed && Contains(sample.hit.voxel, lo, hi)))
+					touched = true;
+			}
+			if (touched)
+				for (int s = 0; s < samples; ++s)
+					cache[pixel * samples + s].valid = false;
+		}
+		std::fill(sum.begin(), sum.end(), Color{ 0, 0, 0 });
+		std::fill(count.begin(), count.end(), 0);
+	}
+
+	void Render(Tree& tree, const Camera& camera, FrameBuffer& out)
+	{
+		int s = frame++ % samples;
+		for (int y = 0; y < height; ++y)
+		{
+			{
+				ProfileScope scope("trace");
+				int size = 0;
+				for (int x = 0; x < width; ++x)
+					if (!cache[(x + y * width) * samples + s].valid)
+					{
+						pending[size] = x;
+						rays[size++] = camera(x, y, s);
+					}
+				tree.IntersectN(rays.data(), tmax.data(), size, { points.data(), voxels.data(), normals.data(), materials.data(), distances.data() });
+				for (int i = 0; i < size; ++i)
+				{
+					Sample& sample = cache[(pending[i] + y * width) * samples + s];
+					sample.ray = rays[i];
+					sample.hit = { points[i], voxels[i], normals[i], materials[i], distances[i] };
+					sample.missed = materials[i] < 0;
+					sample.valid = true;
+				}
+			}
+			ProfileScope scope("shade");
+			for (int x = 0; x < width; ++x)
+			{
+				int pixel = x + y * width;
+				const Sample& sample = cache[pixel * samples + s];
+				if (!sample.missed)
+					sum[pixel] += tree.Shade(sample.ray, sample.hit, cone);
+				++count[pixel];
+				out.at(x, y) = sum[pixel] / (float)count[pixel];
+				out.surfaceAt(x, y) = Surface(sample);
+			}
+		}
+	}
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include "base.h"
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+template <typename Tree, size_t Dimension>
+class CellularAutomaton
+{
+	using index_p = IndexPoint<Dimension>;
+	using i_vector = iVector<Dimension>;
+
+public:
+	static constexpr int RegionDepth = 3;
+
+	using Applied = std::function<void(const index_p*, int)>;
+
+	struct Neighborhood
+	{
+		const int* cells;
+		const int* stride;
+		index_p position;
+
+		int center() const
+		{
+			return *cells;
+		}
+
+		int operator[](const i_vector& offset) const
+		{
+			int index = 0;
+			for (int i = 0; i < Dimension; ++i)
+				index += offset[i] * stride[i];
+			return cells[index];
+		}
+	};
+
+private:
+	static constexpr int Extent = (1 << RegionDepth) + 2;
+
+	Tree& tree;
+	int regions;
+	int threads;
+	std::vector<unsigned char> active;
+	std::vector<index_p> pending;
+	Applied applied;
+
+	int RegionIndex(const index_p& region) const
+	{
+		int index = 0;
+		for (int i = Dimension - 1; i >= 0; --i)
+			index = index * regions + region[i];
+		return index;
+	}
+
+	void ActivateRegion(const index_p& region)
+	{
+		for (int i = 0; i < Dimension; ++i)
+			if (region[i] < 0 || region[i] >= regions)
+				return;
+		unsigned char& flag = active[RegionIndex(region)];
+		if (!flag)
+		{
+			flag = 1;
+			pending.push_back(region);
+		}
+	}
+
+	template <typename Rule>
+	void StepRegion(const index_p& region, const Rule& rule, std::vector<index_p>& points, std::vector<int>& cells,
+		std::vector<index_p>& changed, std::vector<int>& materials) const
+	{
+		int size = tree.size();
+		index_p lo = (region << RegionDepth) - i_vector(1);
+		index_p::forEach(Extent, [&](const index_p& i) {
+			index_p p = index_p::Min(index_p::Max(lo + (i - index_p(0)), 0), size - 1);
+			int index = 0;
+			for (int d = Dimension - 1; d >= 0; --d)
+				index = index * Extent + i[d];
+			points[index] = p;
+		});
+		tree.getMaterials(points.data(), cells.data(), (int)points.size());
+
+		int stride[Dimension];
+		for (int d = 0, s = 1; d < Dimension; ++d, s *= Extent)
+			stride[d] = s;
+		index_p::forEach(Extent, [&](const index_p& i) {
+			for (int d = 0; d < Dimension; ++d)
+				if (lo[d] + i[d] < 0 || lo[d] + i[d] >= size)
+				{
+					int index = 0;
+					for (int k = Dimension - 1; k >= 0; --k)
+						index = index * Extent + i[k];
+					cells[index] = -1;
+					return;
+				}
+		});
+
+		index_p::forEach(1 << RegionDepth, [&](const index_p& i) {
+			int index = 0;
+			for (int d = Dimension - 1; d >= 0; --d)
+				index = index * Extent + i[d] + 1;
+			index_p p = lo + (i - index_p(0)) + i_vector(1);
+			int material = rule(Neighborhood{ &cells[index], stride, p });
+			if (material != cells[index])
+			{
+				changed.push_back(p);
+				materials.push_back(material);
+			}
+		});
+	}
+
+public:
+	CellularAutomaton(Tree& tree) :
+		tree(tree),
+		regions(tree.size() >> RegionDepth),
+		threads((std::max)(1u, std::thread::hardware_concurrency()))
+	{
+		int count = 1;
+		for (int i = 0; i < Dimension; ++i)
+			count *= regions;
+		active.assign(count, 0);
+	}
+
+	void Activate(const index_p& p)
+	{
+		index_p::forEach(3, [&](const index_p& i) {
+			index_p q = p + (i - index_p(1));
+			ActivateRegion(q >> RegionDepth);
+		});
+	}
+
+	void ActivateAll()
+	{
+		index_p::forEach(regions, [&](const index_p& region) { ActivateRegion(region); });
+	}
+
+	void setMaterial(const index_p& p, int material)
+	{
+		tree.setMaterial(p, material);
+		Activate(p);
+	}
+
+	int size() const
+	{
+		return tree.size();
+	}
+
+	int activeRegions() const
+	{
+		return (int)pending.size();
+	}
+
+	void OnApply(Applied callback)
+	{
+		applied = callback;
+	}
+
+	template <typename Rule>
+	int Step(const Rule& rule)
+	{
+		std::vector<index_p> current;
+		current.swap(pending);
+		for (const index_p& region : current)
+			active[RegionIndex(region)] = 0;
+
+		int count = (std::min)(threads, (int)current.size());
+		std::vector<std::vector<index_p>> changed(count);
+		std::vector<std::vector<int>> materials(count);
+		std::vector<std::thread> workers;
+		for (int t = 0; t < count; ++t)
+			workers.emplace_back([&, t] {
+				int cells_count = 1;
+				for (int d = 0; d < Dimension; ++d)
+					cells_count *= Extent;
+				std::vector<index_p> points(cells_count);
+				std::vector<int> cells(cells_count);
+				for (size_t r = current.size() * t / count; r < current.size() * (t + 1) / count; ++r)
+					StepRegion(current[r], rule, points, cells, changed[t], materials[t]);
+			});
+		for (std::thread& worker : workers)
+			worker.join();
+
+		int total = 0;
+		for (int t = 0; t < count; ++t)
+		{
+			tree.setMaterials(changed[t].data(), materials[t].data(), (int)changed[t].size());
+			if (applied)
+				applied(changed[t].data(), (int)changed[t].size());
+			for (const index_p& p : changed[t])
+				Activate(p);
+			total += (int)changed[t].size();
+		}
+		return total;
+	}
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include "base.h"
+#include <algorithm>
+#include <vector>
+
+
+template <size_t Dimension>
+struct VoxelCell
+{
+	IndexPoint<Dimension> corner;
+	int level;
+	int material;
+};
+
+
+template <typename Tree, size_t Dimension>
+class ConnectedComponents
+{
+	using index_p = IndexPoint<Dimension>;
+
+	std::vector<VoxelCell<Dimension>> cells;
+	std::vector<int> parent;
+	std::vector<int> labels;
+	std::vector<long long> volumes;
+	std::vector<bool> border;
+	int size;
+
+	int Find(int cell)
+	{
+		while (parent[cell] != cell)
+		{
+			parent[cell] = parent[parent[cell]];
+			cell = parent[cell];
+		}
+		return cell;
+	}
+
+	static bool MortonLess(const index_p& a, const index_p& b)
+	{
+		int best = Dimension - 1;
+		int bits = a[best] ^ b[best];
+		for (int i = Dimension - 2; i >= 0; --i)
+		{
+			int x = a[i] ^ b[i];
+			if (bits < x && bits < (bits ^ x))
+			{
+				best = i;
+				bits = x;
+			}
+		}
+		return a[best] < b[best];
+	}
+
+	int CellAt(const index_p& p) const
+	{
+		auto found = std::upper_bound(cells.begin(), cells.end(), p, [](const index_p& point, const VoxelCell<Dimension>& cell) {
+			return MortonLess(point, cell.corner);
+		});
+		return (int)(found - cells.begin()) - 1;
+	}
+
+public:
+	template <typename Filter>
+	ConnectedComponents(const Tree& tree, Filter filter) : size(tree.size())
+	{
+		tree.VisitCells(
+			[&](const index_p& corner, int level, int material) {
+				parent.push_back((int)cells.size());
+				cells.push_back({ corner, level, material });
+			},
+			[&](int a, int b, int axis) {
+				if (!filter(cells[a].material) || !filter(cells[b].material))
+					return;
+				int ra = Find(a), rb = Find(b);
+				if (ra != rb)
+					parent[(std::max)(ra, rb)] = (std::min)(ra, rb);
+			});
+
+		labels.assign(cells.size(), -1);
+		for (int cell = 0; cell < (int)cells.size(); ++cell)
+		{
+			const VoxelCell<Dimension>& c = cells[cell];
+			if (!filter(c.material))
+				continue;
+			int root = Find(cell);
+			if (labels[root] < 0)
+			{
+				labels[root] = (int)volumes.size();
+				volumes.push_back(0);
+				border.push_back(false);
+			}
+			int label = labels[cell] = labels[root];
+			int extent = 1 << c.level;
+			volumes[label] += 1ll << (c.level * Dimension);
+			for (int i = 0; i < Dimension; ++i)
+				if (c.corner[i] == 0 || c.corner[i] + extent == size)
+					border[label] = true;
+		}
+	}
+
+	int count() const
+	{
+		return (int)volumes.size();
+	}
+
+	int Label(const index_p& p) const
+	{
+		return labels[CellAt(p)];
+	}
+
+	long long Volume(int label) const
+	{
+		return volumes[label];
+	}
+
+	bool Enclosed(int label) const
+	{
+		return !border[label];
+	}
+
+	template <typename Action>
+	void forEachCell(int label, Action action) const
+	{
+		for (int cell = 0; cell < (int)cells.size(); ++cell)
+			if (labels[cell] == label)
+				action(cells[cell]);
+	}
+
+	void Fill(Tree& tree, int label, int material) const
+	{
+		forEachCell(label, [&](const VoxelCell<Dimension>& cell) {
+			tree.setRegion(cell.corner, cell.level, material);
+		});
+	}
+};
+
+
+template <typename Tree, size_t Dimension>
+long long FloodFill(Tree& tree, const IndexPoint<Dimension>& seed, int material)
+{
+	int from = tree.getMaterial(seed);
+	if (from == material)
+		return 0;
+	ConnectedComponents<Tree, Dimension> components(tree, [from](int m) { return m == from; });
+	int label = components.Label(seed);
+	components.Fill(tree, label, material);
+	return components.Volume(label);
+}
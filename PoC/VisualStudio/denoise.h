@@ -0,0 +1,172 @@
+#pragma once
+#include "graph.h"
+#include "pipeline.h"
+#include "profile.h"
+#include <cmath>
+#include <thread>
+#include <vector>
+
+
+class Denoiser
+{
+	struct Plane
+	{
+		std::vector<float> r, g, b;
+
+		void resize(size_t size)
+		{
+			r.resize(size);
+			g.resize(size);
+			b.resize(size);
+		}
+	};
+
+	int iterations;
+	float depth_sigma;
+	float color_sigma;
+	int threads;
+	int frame;
+
+	Plane planes[2];
+	std::vector<int> normals;
+	std::vector<int> materials;
+	std::vector<float> depths;
+	std::vector<float> luminance;
+
+	static float Luminance(float r, float g, float b)
+	{
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	}
+
+	void Demodulate(const FrameBuffer& buffer, size_t begin, size_t end)
+	{
+		Plane& plane = planes[0];
+		for (size_t i = begin; i < end; ++i)
+		{
+			const SurfaceSample& surface = buffer.surfaces[i];
+			const Color& color = buffer.pixels[i];
+			normals[i] = surface.normal;
+			materials[i] = surface.material;
+			depths[i] = surface.depth;
+			plane.r[i] = surface.albedo.r > 0 ? color.r / surface.albedo.r : color.r;
+			plane.g[i] = surface.albedo.g > 0 ? color.g / surface.albedo.g : color.g;
+			plane.b[i] = surface.albedo.b > 0 ? color.b / surface.albedo.b : color.b;
+		}
+	}
+
+	void Remodulate(FrameBuffer& buffer, const Plane& plane, size_t begin, size_t end) const
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const SurfaceSample& surface = buffer.surfaces[i];
+			buffer.pixels[i] = {
+				surface.albedo.r > 0 ? plane.r[i] * surface.albedo.r : plane.r[i],
+				surface.albedo.g > 0 ? plane.g[i] * surface.albedo.g : plane.g[i],
+				surface.albedo.b > 0 ? plane.b[i] * surface.albedo.b : plane.b[i]
+			};
+		}
+	}
+
+	void Measure(const Plane& in, size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+			luminance[i] = Luminance(in.r[i], in.g[i], in.b[i]);
+	}
+
+	void Pass(const Plane& in, Plane& out, int width, int height, int y0, int y1, int step, float sigma)
+	{
+		static const float kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+		float inv_color = 1 / (sigma * sigma + 1e-6f);
+		for (int y = y0; y < y1; ++y)
+			for (int x = 0; x < width; ++x)
+			{
+				int i = x + y * width;
+				if (normals[i] == 0)
+				{
+					out.r[i] = in.r[i];
+					out.g[i] = in.g[i];
+					out.b[i] = in.b[i];
+					continue;
+				}
+
+				float depth = depths[i];
+				float inv_depth = 1 / (depth_sigma * depth * step + 1e-6f);
+				float lum = luminance[i];
+				float r = 0, g = 0, b = 0, total = 0;
+				for (int dy = -2; dy <= 2; ++dy)
+				{
+					int sy = y + dy * step;
+					if (sy < 0 || sy >= height)
+						continue;
+					for (int dx = -2; dx <= 2; ++dx)
+					{
+						int sx = x + dx * step;
+						if (sx < 0 || sx >= width)
+							continue;
+						int j = sx + sy * width;
+						if (normals[j] != normals[i] || materials[j] != materials[i])
+							continue;
+						float dz = std::fabs(depths[j] - depth) * inv_depth;
+						float dl = luminance[j] - lum;
+						float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)]
+							* std::exp(-dz - dl * dl * inv_color);
+						r += in.r[j] * weight;
+						g += in.g[j] * weight;
+						b += in.b[j] * weight;
+						total += weight;
+					}
+				}
+				out.r[i] = r / total;
+				out.g[i] = g / total;
+				out.b[i] = b / total;
+			}
+	}
+
+public:
+	Denoiser(int iterations = 4, float depth_sigma = 0.02f, float color_sigma = 2.0f) :
+		iterations(iterations),
+		depth_sigma(depth_sigma),
+		color_sigma(color_sigma),
+		threads((std::max)(1u, std::thread::hardware_concurrency())),
+		frame(-1)
+	{ }
+
+	void Apply(FrameBuffer& buffer)
+	{
+		frame = buffer.index;
+		ProfileScope scope("denoise", frame);
+		size_t size = buffer.pixels.size();
+		planes[0].resize(size);
+		planes[1].resize(size);
+		normals.resize(size);
+		materials.resize(size);
+		depths.resize(size);
+		luminance.resize(size);
+
+		int width = buffer.width, height = buffer.height;
+		int count = (std::max)(1, (std::min)(threads, height));
+		Barrier barrier(count);
+		std::vector<std::thread> workers;
+		for (int t = 0; t < count; ++t)
+			workers.emplace_back([&, t] {
+				int y0 = height * t / count, y1 = height * (t + 1) / count;
+				size_t begin = (size_t)y0 * width, end = (size_t)y1 * width;
+				Demodulate(buffer, begin, end);
+				float sigma = color_sigma;
+				int current = 0;
+				for (int it = 0; it < iterations; ++it)
+				{
+					ProfileScope scope("denoise pass", frame);
+					Measure(planes[current], begin, end);
+					barrier.wait();
+					Pass(planes[current], planes[current ^ 1], width, height, y0, y1, 1 << it, sigma);
+					barrier.wait();
+					current ^= 1;
+					sigma /= 2;
+				}
+				Remodulate(buffer, planes[current], begin, end);
+			});
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+};
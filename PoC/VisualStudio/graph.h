@@ -1,5 +1,8 @@
 #pragma once
 
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
 #include <Windows.h>
 #include <cmath>
 
@@ -57,6 +60,15 @@ struct Color
 };
 
 
+struct SurfaceSample
+{
+	int normal;
+	int material;
+	float depth;
+	Color albedo;
+};
+
+
 class Canvas
 {
 	HDC hdc;
@@ -1,25 +1,25 @@
 #include "graph.h"
 #include "base.h"
 #include "octotree.h"
+#include "pipeline.h"
+#include "network.h"
+#include "denoise.h"
+#include "accumulate.h"
+#include "vox.h"
+#include "scene.h"
+#include "automaton.h"
+#include "mesh.h"
+#include "connectivity.h"
+#include "profile.h"
+#include "progressive.h"
 
 #include <iostream>
+#include <fstream>
 #include <array>
 #include <string>
 #include <vector>
 #include <stdio.h>
 #include <algorithm>
-#include <chrono>
-
-
-namespace chn = std::chrono;
-
-double DeltaTime() {
-	static chn::steady_clock::time_point old_time = chn::steady_clock::now();
-	chn::steady_clock::time_point new_time = chn::steady_clock::now();
-	double last_dt = chn::duration_cast<chn::duration<double, std::ratio<1>>>(new_time - old_time).count();
-	old_time = new_time;
-	return last_dt;
-}
 
 
 std::vector<Material> materialTable{
@@ -36,50 +36,488 @@ template <typename T>
 void sliceOctotree(const T& tree, Canvas& canvas)
 {
 	int size = tree.size();
+	std::vector<IndexPoint<3>> points(size * size);
+	std::vector<int> materials(size * size);
 	for (int x = 0; x < size; ++x)
+	{
 		for (int y = 0; y < size; ++y)
 			for (int z = 0; z < size; ++z)
-				canvas.setPixel(y, z + 150, materialTable[tree.getMaterial({ x, y, z })].color);
+				points[y * size + z] = { x, y, z };
+		tree.getMaterials(points.data(), materials.data(), size * size);
+		for (int y = 0; y < size; ++y)
+			for (int z = 0; z < size; ++z)
+				canvas.setPixel(y, z + 150, materialTable[materials[y * size + z]].color);
+	}
 }
 
 
 
-int main()
-{
-	int size = 500;
-	int deviations = 3;
-	Canvas canvas(100, 150, size, size);
+using Tree = OctoTree<3, 7>;
+
+const unsigned short FarmPort = 27015;
+const int AcceptTimeout = 10000;
+const char* SceneFile = "scene.oct";
+const char* TraceFile = "trace.json";
 
-	OctoTree<3, 7>* tree = new OctoTree<3, 7>();
-	VoxelDriver<OctoTree<3, 7>, 3> driver(*tree);
-	driver.FillRectangle({ 0, 0, 0 }, { 1, 128, 128 }, 1);
-	driver.FillRectangle({ 0, 0, 0 }, { 128, 1, 128 }, 1);
-	driver.FillRectangle({ 0, 0, 0 }, { 128, 128, 1 }, 4);
-	driver.FillRectangle({ 127, 0, 0 }, { 1, 128, 128 }, 1);
-	driver.FillRectangle({ 0, 127, 0 }, { 128, 1, 128 }, 1);
-	driver.FillRectangle({ 0, 0, 127 }, { 128, 128, 1 }, 5);
 
+void BuildScene(Tree& tree)
+{
+	ProfileScope scope("build");
+	VoxelDriver<Tree, 3> driver(tree);
+	tree.DeferCollapse();
 	driver.FillRectangle({ 10, 10, 80 }, { 20, 20, 20 }, 3);
 	driver.FillCircle({ 30, 70, 80 }, 30, 2);
+	tree.Optimize();
+
+	Tree* room = new Tree();
+	Tree* interior = new Tree();
+	int last = room->size() - 1;
+	room->Build([last](const IndexPoint<3>& p) {
+		if (p[2] == last)
+			return 5;
+		return p[2] == 0 && p[0] != last && p[1] != last ? 4 : 1;
+	});
+	interior->Build([last](const IndexPoint<3>& p) {
+		for (int d = 0; d < 3; ++d)
+			if (p[d] == 0 || p[d] == last)
+				return 0;
+		return 1;
+	});
+	room->Combine(*interior, CsgOperation::Subtraction);
+	tree.Combine(*room, CsgOperation::Union);
+	delete interior;
+	delete room;
+}
+
+
+Ray<3> CameraRay(int x, int y, int size, int i, int j, int deviations)
+{
+	return {{125.1, 64.1, 70.1},
+		fVector<3>{-size / 2.0f,
+			(float)(x - size / 2) + i / (float) deviations,
+			(float)(y - size / 2) + j / (float) deviations
+			}.Norm() };
+}
+
+
+void ImportScene(Tree& tree, const char* path)
+{
+	ProfileScope scope("build");
+	std::ifstream in(path, std::ios::binary);
+	VoxModel model = LoadVox(in);
+	std::array<int, 256> materials = AppendPalette(model, materialTable);
+	tree.Build([&](const IndexPoint<3>& p) { return materials[model.at(p)]; });
+}
+
+
+Color RenderPixel(Tree& tree, int x, int y, int size, int deviations)
+{
+	float cone = 2.0f / (size * deviations);
+	Color color = {0, 0, 0};
+	for (int i = 0; i < deviations; ++i)
+		for (int j = 0; j < deviations; ++j)
+			color = color + tree.Trace(CameraRay(x, y, size, i, j, deviations), cone);
+	return color / (deviations * deviations);
+}
+
+
+Color RenderPixel(Tree& tree, int x, int y, int size, SurfaceSample& surface)
+{
+	return tree.Trace(CameraRay(x, y, size, 1, 1, 2), 2.0f / size, surface);
+}
+
+
+void Present(Canvas& canvas, FrameBuffer& buffer)
+{
+	ProfileScope scope("output");
+	for (int y = 0; y < buffer.height; ++y)
+		for (int x = 0; x < buffer.width; ++x)
+			canvas.setPixel(x, y, buffer.at(x, y));
+	canvas.Draw();
+}
 
 
-	DeltaTime();
+void RenderRows(Tree& tree, FrameBuffer& buffer, int size)
+{
 	for (int y = 0; y < size; ++y)
+	{
+		ProfileScope scope("trace");
+		for (int x = 0; x < size; ++x)
+			buffer.at(x, y) = RenderPixel(tree, x, y, size, buffer.surfaceAt(x, y));
+	}
+}
+
+
+void ReportProfile()
+{
+	Profiler& profiler = Profiler::Instance();
+	profiler.Summary(std::cout);
+	std::ofstream out(TraceFile);
+	profiler.WriteTrace(out);
+}
+
+
+int RunWorker(unsigned short port, const char* scene, int size, int deviations)
+{
+	Tree* tree = new Tree();
+	std::ifstream in(scene, std::ios::binary);
+	tree->Load(in);
+	tree->EnableDistanceField();
+
+	WinsockSession session;
+	TileWorker worker(port);
+	worker.Run([&](int x, int y) { return RenderPixel(*tree, x, y, size, deviations); });
+	delete tree;
+	return 0;
+}
+
+
+int RunFarm(int workers, int size, int deviations)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+	{
+		std::ofstream out(SceneFile, std::ios::binary);
+		tree->Save(out);
+	}
+
+	WinsockSession session;
+	TileCoordinator coordinator(FarmPort);
+	int spawned = 0;
+	for (int i = 0; i < workers; ++i)
+		if (SpawnProcess("--worker " + std::to_string(FarmPort) + " " + SceneFile))
+			++spawned;
+	int connected = coordinator.Accept(spawned, AcceptTimeout);
+	if (connected < workers)
+		std::cout << "workers connected: " << connected << " of " << workers << std::endl;
+	if (connected == 0)
+	{
+		delete tree;
+		return 1;
+	}
+
+	FrameBuffer buffer(size, size);
+	{
+		ProfileScope scope("tiles");
+		coordinator.Render(SplitTiles(size, size, 32), buffer);
+	}
+	coordinator.Shutdown();
+
+	Present(canvas, buffer);
+	ReportProfile();
+	delete tree;
+	return 0;
+}
+
+
+int RunPreview(int frames, int size, const char* scene)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* tree = new Tree();
+	if (scene)
+		ImportScene(*tree, scene);
+	else
+		BuildScene(*tree);
+	tree->EnableDistanceField();
+
+	int samples = 4;
+	Accumulator<Tree, 3> accumulator(size, size, samples, 2.0f / size);
+	FramePipeline<Tree, 3> pipeline(*tree, size, size);
+	pipeline.OnApply([&](const EditList<3>& edits) {
+		accumulator.Invalidate(edits.points.data(), (int)edits.points.size());
+	});
+	pipeline.Run(frames,
+		[&](int frame, EditList<3>& edits) {
+			if (frame != frames / 2)
+				return;
+			VoxelDriver<EditList<3>, 3> editor(edits);
+			editor.FillRectangle({ 60, 56, 56 }, { 8, 16, 16 }, 3);
+		},
+		[&](int frame, FrameBuffer& buffer) {
+			accumulator.Render(*tree, [&](int x, int y, int s) {
+				return CameraRay(x, y, size, s % 2, s / 2, 2);
+			}, buffer);
+		},
+		[&](FrameBuffer& buffer) {
+			Present(canvas, buffer);
+		});
+	pipeline.Report(std::cout);
+	ReportProfile();
+
+	delete tree;
+	return 0;
+}
+
+
+int RunProgressive(int size, int deviations)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+	tree->EnableDistanceField();
+
+	int image = 0;
+	Profiler::SetFrame(image);
+	ProgressiveRenderer<Tree, 3> renderer(size, size, deviations * deviations, 2.0f / (size * deviations));
+	FrameBuffer buffer(size, size);
+	renderer.Render(*tree, [&](int x, int y, int s) {
+			return CameraRay(x, y, size, s / deviations, s % deviations, deviations);
+		}, buffer,
+		[&](FrameBuffer& partial) {
+			Present(canvas, partial);
+			Profiler::SetFrame(++image);
+		});
+	ReportProfile();
+
+	delete tree;
+	return 0;
+}
+
+
+int RunInstances(int count, int size, int deviations)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* room = new Tree();
+	BuildScene(*room);
+	room->EnableDistanceField();
+	Tree* prop = new Tree();
+	prop->Build([](const IndexPoint<3>& p) {
+		return (p - IndexPoint<3>(4)).Sqr() < 16 ? 2 : 0;
+	});
+
+	InstancedScene<Tree, 3> scene;
+	scene.Add(*room, RigidTransform<3>::Translation({ 0, 0, 0 }));
+	for (int i = 0; i < count; ++i)
+		scene.Add(*prop, RigidTransform<3>::Translation({ 20.0f + i % 10 * 9, 10.0f + i / 10 % 10 * 11, 40.0f + i / 100 * 15 }));
+	scene.Build();
+
+	FrameBuffer buffer(size, size);
+	for (int y = 0; y < size; ++y)
+	{
+		ProfileScope scope("trace");
 		for (int x = 0; x < size; ++x)
 		{
-			Color color = {0, 0, 0};
+			Color color = { 0, 0, 0 };
 			for (int i = 0; i < deviations; ++i)
 				for (int j = 0; j < deviations; ++j)
-					color = color + tree->Trace({{125.1, 64.1, 70.1},
-								fVector<3>{-size / 2.0f,
-									(float)(x - size / 2) + i / (float) deviations,
-									(float)(y - size / 2) + j / (float) deviations
-									}.Norm() });
-			canvas.setPixel(x, y, color / (deviations * deviations));
+					color += scene.Trace(CameraRay(x, y, size, i, j, deviations));
+			buffer.at(x, y) = color / (deviations * deviations);
 		}
-	double time = DeltaTime();
-	std::cout << time << std::endl;
+	}
+	prop->MemoryReport(std::cout);
+
+	Present(canvas, buffer);
+	ReportProfile();
+	delete prop;
+	delete room;
+	return 0;
+}
+
+
+int FallingSand(const CellularAutomaton<Tree, 3>::Neighborhood& cell)
+{
+	const int sand = 2;
+	iVector<3> down(0);
+	down[2] = 1;
+	if (cell.center() == 0 && cell[iVector<3>(0) - down] == sand)
+		return sand;
+	if (cell.center() == sand && cell[down] == 0)
+		return 0;
+	return cell.center();
+}
+
+
+float ShadowedFloor(const Tree& tree, int samples)
+{
+	ProfileScope scope("shadow");
+	std::vector<Ray<3>> rays;
+	std::vector<float> tmax;
+	for (int j = 0; j < samples; ++j)
+		for (int i = 0; i < samples; ++i)
+		{
+			rays.push_back({ { 1 + 126.0f * (i + 0.5f) / samples, 1 + 126.0f * (j + 0.5f) / samples, 126.5f }, fVector<3>{ 0, 0, -1 } });
+			tmax.push_back(125.5f);
+		}
+
+	std::vector<unsigned long long> occluded((rays.size() + 63) / 64);
+	tree.OccludedN(rays.data(), tmax.data(), (int)rays.size(), occluded.data());
+	int shadowed = 0;
+	for (size_t i = 0; i < rays.size(); ++i)
+		shadowed += (occluded[i / 64] >> (i % 64)) & 1;
+	return (float)shadowed / rays.size();
+}
+
+
+int RunSand(int frames, int size)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+	tree->EnableDistanceField();
+
+	CellularAutomaton<Tree, 3> automaton(*tree);
+	VoxelDriver<CellularAutomaton<Tree, 3>, 3> driver(automaton);
+	driver.FillRectangle({ 40, 50, 5 }, { 30, 30, 20 }, 2);
+	automaton.ActivateAll();
+
+	SurfaceMesher<Tree> mesher(*tree);
+	mesher.Update();
+	automaton.OnApply([&](const IndexPoint<3>* points, int count) {
+		for (int i = 0; i < count; ++i)
+			mesher.Invalidate(points[i]);
+	});
+
+	Denoiser denoiser;
+	FrameBuffer buffer(size, size);
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		Profiler::SetFrame(frame);
+		buffer.index = frame;
+		int changed;
+		{
+			ProfileScope scope("step");
+			changed = automaton.Step(FallingSand);
+		}
+		int remeshed;
+		{
+			ProfileScope scope("mesh");
+			remeshed = mesher.Update();
+		}
+		std::cout << "changed " << changed << ", active " << automaton.activeRegions() << ", shadowed " << ShadowedFloor(*tree, 64)
+			<< ", remeshed " << remeshed << " chunks" << std::endl;
+
+		RenderRows(*tree, buffer, size);
+		denoiser.Apply(buffer);
+		Present(canvas, buffer);
+	}
+
+	SurfaceMesher<Tree> full(*tree);
+	{
+		ProfileScope scope("full mesh");
+		full.Update();
+	}
+	const std::vector<MeshVertex>& a = mesher.meshVertices();
+	const std::vector<MeshVertex>& b = full.meshVertices();
+	bool same = a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const MeshVertex& u, const MeshVertex& v) {
+		return u.position[0] == v.position[0] && u.position[1] == v.position[1] && u.position[2] == v.position[2]
+			&& u.normal[0] == v.normal[0] && u.normal[1] == v.normal[1] && u.normal[2] == v.normal[2] && u.material == v.material;
+	});
+	std::cout << "incremental mesh " << (same ? "matches" : "differs from") << " full remesh, " << a.size() << " vertices" << std::endl;
+	ReportProfile();
+
+	delete tree;
+	return 0;
+}
+
+
+int RunFlood(int size)
+{
+	Canvas canvas(100, 150, size, size);
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+
+	VoxelDriver<Tree, 3> driver(*tree);
+	driver.FillRectangle({ 13, 13, 83 }, { 14, 14, 14 }, 0);
+	driver.FillRectangle({ 56, 0, 100 }, { 16, 1, 27 }, 0);
+
+	{
+		ProfileScope scope("flood");
+		ConnectedComponents<Tree, 3> air(*tree, [](int m) { return m == 0; });
+		for (int label = 0; label < air.count(); ++label)
+		{
+			bool sealed = air.Enclosed(label);
+			std::cout << "air pocket " << label << ": " << air.Volume(label) << " voxels, " << (sealed ? "sealed" : "open") << std::endl;
+			if (sealed)
+				air.Fill(*tree, label, 3);
+		}
+		std::cout << "recolored " << FloodFill(*tree, IndexPoint<3>{ 30, 70, 80 }, 3) << " voxels" << std::endl;
+	}
+	tree->EnableDistanceField();
+
+	Denoiser denoiser;
+	FrameBuffer buffer(size, size);
+	Profiler::SetFrame(0);
+	RenderRows(*tree, buffer, size);
+	denoiser.Apply(buffer);
+	Present(canvas, buffer);
+	ReportProfile();
+
+	delete tree;
+	return 0;
+}
+
+
+int RunMesh(const char* path)
+{
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+
+	SurfaceMesher<Tree> mesher(*tree);
+	int chunks;
+	{
+		ProfileScope scope("mesh");
+		chunks = mesher.Update();
+	}
+	std::cout << "chunks " << chunks << ", vertices " << mesher.vertexCount() << ", indices " << mesher.indexCount() << std::endl;
+
+	std::ofstream out(path);
+	mesher.WriteObj(out);
+	ReportProfile();
+	delete tree;
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int size = 500;
+	int deviations = 3;
+
+	if (argc == 4 && std::string(argv[1]) == "--worker")
+		return RunWorker((unsigned short)std::stoi(argv[2]), argv[3], size, deviations);
+	if (argc == 3 && std::string(argv[1]) == "--farm")
+		return RunFarm(std::stoi(argv[2]), size, deviations);
+	if (argc == 3 && std::string(argv[1]) == "--preview")
+		return RunPreview(std::stoi(argv[2]), size, nullptr);
+	if (argc == 3 && std::string(argv[1]) == "--sand")
+		return RunSand(std::stoi(argv[2]), size);
+	if (argc == 3 && std::string(argv[1]) == "--instances")
+		return RunInstances(std::stoi(argv[2]), size, deviations);
+	if (argc == 4 && std::string(argv[1]) == "--vox")
+		return RunPreview(std::stoi(argv[3]), size, argv[2]);
+	if (argc == 2 && std::string(argv[1]) == "--progressive")
+		return RunProgressive(size, deviations);
+	if (argc == 3 && std::string(argv[1]) == "--mesh")
+		return RunMesh(argv[2]);
+	if (argc == 2 && std::string(argv[1]) == "--flood")
+		return RunFlood(size);
+
+	Canvas canvas(100, 150, size, size);
+
+	Tree* tree = new Tree();
+	BuildScene(*tree);
+	tree->EnableDistanceField();
+	tree->MemoryReport(std::cout);
+
+	int frames = 4;
+	Denoiser denoiser;
+	FramePipeline<Tree, 3> pipeline(*tree, size, size);
+	pipeline.Run(frames,
+		[&](int frame, EditList<3>& edits) {
+			VoxelDriver<EditList<3>, 3> editor(edits);
+			editor.FillRectangle({ 10, 10 + (frame - 1) * 8, 80 }, { 20, 20, 20 }, 0);
+			editor.FillRectangle({ 10, 10 + frame * 8, 80 }, { 20, 20, 20 }, 3);
+		},
+		[&](int frame, FrameBuffer& buffer) {
+			RenderRows(*tree, buffer, size);
+		},
+		[&](FrameBuffer& buffer) {
+			denoiser.Apply(buffer);
+			Present(canvas, buffer);
+		});
+	pipeline.Report(std::cout);
+	ReportProfile();
 
-	canvas.Draw();
 	delete tree;
 }
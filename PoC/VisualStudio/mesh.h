@@ -0,0 +1,262 @@
+#pragma once
+#include "base.h"
+#include <algorithm>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+
+struct MeshVertex
+{
+	fPoint<3> position;
+	iVector<3> normal;
+	int material;
+};
+
+
+template <typename Tree>
+class SurfaceMesher
+{
+	using index_p = IndexPoint<3>;
+	using i_vector = iVector<3>;
+
+public:
+	static constexpr int ChunkDepth = 5;
+
+private:
+	static constexpr int ChunkSize = 1 << ChunkDepth;
+	static constexpr int Extent = ChunkSize + 2;
+
+	struct Chunk
+	{
+		std::vector<MeshVertex> vertices;
+		size_t first;
+		bool dirty;
+	};
+
+	const Tree& tree;
+	int chunks;
+	int threads;
+	std::vector<Chunk> grid;
+	std::vector<MeshVertex> vertices;
+	std::vector<unsigned> indices;
+
+	int ChunkIndex(const index_p& chunk) const
+	{
+		return chunk[0] + chunks * (chunk[1] + chunks * chunk[2]);
+	}
+
+	static void EmitQuad(std::vector<MeshVertex>& out, int axis, int sign, int plane, int u0, int v0, int u1, int v1, int material)
+	{
+		int u = (axis + 1) % 3, v = (axis + 2) % 3;
+		int us[] = { u0, u1, u1, u0 };
+		int vs[] = { v0, v0, v1, v1 };
+		i_vector normal(0);
+		normal[axis] = sign;
+		for (int k = 0; k < 4; ++k)
+		{
+			int corner = sign > 0 ? k : 3 - k;
+			MeshVertex vertex;
+			vertex.position[axis] = (float)plane;
+			vertex.position[u] = (float)us[corner];
+			vertex.position[v] = (float)vs[corner];
+			vertex.normal = normal;
+			vertex.material = material;
+			out.push_back(vertex);
+		}
+	}
+
+	void MeshChunk(const index_p& chunk, std::vector<int>& cells, std::vector<int>& mask, std::vector<MeshVertex>& out) const
+	{
+		out.clear();
+		index_p origin = chunk << ChunkDepth;
+		int size = tree.size();
+		if (size > ChunkSize && tree.getRegion(origin, ChunkDepth) == 0)
+			return;
+
+		index_p lo = origin - i_vector(1);
+		index_p hi = origin + i_vector(ChunkSize + 1);
+		index_p inner_lo = index_p::Max(lo, index_p(0));
+		index_p inner_hi = index_p::Min(hi, index_p(size));
+		bool inside = true;
+		for (int d = 0; d < 3; ++d)
+			inside &= lo[d] >= 0 && hi[d] <= size;
+		std::fill(cells.begin(), cells.end(), 0);
+		if (inside)
+			tree.getBlock(lo, hi, cells.data());
+		else
+		{
+			std::vector<int> block((size_t)(inner_hi[0] - inner_lo[0]) * (inner_hi[1] - inner_lo[1]) * (inner_hi[2] - inner_lo[2]));
+			tree.getBlock(inner_lo, inner_hi, block.data());
+			int k = 0;
+			index_p::forEach(inner_lo, inner_hi, [&](const index_p& p) {
+				index_p q = p - (lo - index_p(0));
+				cells[q[0] + Extent * (q[1] + Extent * q[2])] = block[k++];
+			});
+		}
+
+		int stride[] = { 1, Extent, Extent * Extent };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			int u = (axis + 1) % 3, v = (axis + 2) % 3;
+			for (int sign = -1; sign <= 1; sign += 2)
+				for (int slice = 0; slice < ChunkSize; ++slice)
+				{
+					bool any = false;
+					for (int j = 0; j < ChunkSize; ++j)
+						for (int i = 0; i < ChunkSize; ++i)
+						{
+							int cell = (slice + 1) * stride[axis] + (i + 1) * stride[u] + (j + 1) * stride[v];
+							int material = cells[cell];
+							int face = material != 0 && cells[cell + sign * stride[axis]] == 0 ? material : 0;
+							mask[i + j * ChunkSize] = face;
+							any |= face != 0;
+						}
+					if (!any)
+						continue;
+
+					int plane = origin[axis] + slice + (sign > 0 ? 1 : 0);
+					for (int j = 0; j < ChunkSize; ++j)
+						for (int i = 0; i < ChunkSize;)
+						{
+							int material = mask[i + j * ChunkSize];
+							if (material == 0)
+							{
+								++i;
+								continue;
+							}
+							int width = 1;
+							while (i + width < ChunkSize && mask[i + width + j * ChunkSize] == material)
+								++width;
+							int height = 1;
+							for (; j + height < ChunkSize; ++height)
+							{
+								const int* row = &mask[i + (j + height) * ChunkSize];
+								if (std::any_of(row, row + width, [material](int m) { return m != material; }))
+									break;
+							}
+							for (int h = 0; h < height; ++h)
+								std::fill_n(&mask[i + (j + h) * ChunkSize], width, 0);
+							EmitQuad(out, axis, sign, plane, origin[u] + i, origin[v] + j, origin[u] + i + width, origin[v] + j + height, material);
+							i += width;
+						}
+				}
+		}
+	}
+
+public:
+	SurfaceMesher(const Tree& tree) :
+		tree(tree),
+		chunks((std::max)(1, tree.size() >> ChunkDepth)),
+		threads((std::max)(1u, std::thread::hardware_concurrency())),
+		grid((size_t)chunks * chunks * chunks)
+	{
+		for (Chunk& chunk : grid)
+			chunk.dirty = true;
+	}
+
+	void Invalidate(const index_p& lo, const index_p& hi)
+	{
+		index_p a = index_p::Max((lo - i_vector(1)) >> ChunkDepth, index_p(0));
+		index_p b = index_p::Min((hi >> ChunkDepth) + i_vector(1), index_p(chunks));
+		index_p::forEach(a, b, [&](const index_p& chunk) { grid[ChunkIndex(chunk)].dirty = true; });
+	}
+
+	void Invalidate(const index_p& p)
+	{
+		Invalidate(p, p + i_vector(1));
+	}
+
+	int Update()
+	{
+		std::vector<index_p> dirty;
+		index_p::forEach(chunks, [&](const index_p& chunk) {
+			if (grid[ChunkIndex(chunk)].dirty)
+				dirty.push_back(chunk);
+		});
+		if (dirty.empty())
+			return 0;
+
+		int count = (std::min)(threads, (int)dirty.size());
+		std::vector<std::thread> workers;
+		for (int t = 0; t < count; ++t)
+			workers.emplace_back([&, t] {
+				std::vector<int> cells(Extent * Extent * Extent);
+				std::vector<int> mask(ChunkSize * ChunkSize);
+				for (size_t c = dirty.size() * t / count; c < dirty.size() * (t + 1) / count; ++c)
+				{
+					Chunk& chunk = grid[ChunkIndex(dirty[c])];
+					MeshChunk(dirty[c], cells, mask, chunk.vertices);
+					chunk.dirty = false;
+				}
+			});
+		for (std::thread& worker : workers)
+			worker.join();
+
+		vertices.resize(vertexCount());
+		indices.resize(indexCount());
+		Write(vertices.data(), indices.data());
+		return (int)dirty.size();
+	}
+
+	size_t vertexCount() const
+	{
+		size_t total = 0;
+		for (const Chunk& chunk : grid)
+			total += chunk.vertices.size();
+		return total;
+	}
+
+	size_t indexCount() const
+	{
+		return vertexCount() / 4 * 6;
+	}
+
+	void Write(MeshVertex* vertex_out, unsigned* index_out)
+	{
+		size_t total = 0;
+		for (Chunk& chunk : grid)
+		{
+			chunk.first = total;
+			total += chunk.vertices.size();
+		}
+
+		int count = (std::min)(threads, (int)grid.size());
+		std::vector<std::thread> workers;
+		for (int t = 0; t < count; ++t)
+			workers.emplace_back([&, t] {
+				for (size_t c = grid.size() * t / count; c < grid.size() * (t + 1) / count; ++c)
+				{
+					const Chunk& chunk = grid[c];
+					std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertex_out + chunk.first);
+					unsigned* index = index_out + chunk.first / 4 * 6;
+					for (size_t q = chunk.first; q < chunk.first + chunk.vertices.size(); q += 4)
+					{
+						unsigned quad[] = { 0, 1, 2, 0, 2, 3 };
+						for (unsigned k : quad)
+							*index++ = (unsigned)q + k;
+					}
+				}
+			});
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	const std::vector<MeshVertex>& meshVertices() const
+	{
+		return vertices;
+	}
+
+	const std::vector<unsigned>& meshIndices() const
+	{
+		return indices;
+	}
+
+	void WriteObj(std::ostream& out) const
+	{
+		for (const MeshVertex& vertex : vertices)
+			out << "v " << vertex.position[0] << " " << vertex.position[1] << " " << vertex.position[2] << "\n";
+		for (size_t i = 0; i < indices.size(); i += 3)
+			out << "f " << indices[i] + 1 << " " << indices[i + 1] + 1 << " " << indices[i + 2] + 1 << "\n";
+	}
+};
@@ -0,0 +1,365 @@
+#pragma once
+#include "graph.h"
+#include "pipeline.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+
+struct Tile
+{
+	int x, y;
+	int width, height;
+};
+
+
+struct TileMessage
+{
+	int frame;
+	Tile tile;
+};
+
+
+class WinsockSession
+{
+public:
+	WinsockSession()
+	{
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw std::runtime_error("WSAStartup failed");
+	}
+
+	WinsockSession(const WinsockSession&) = delete;
+	WinsockSession& operator=(const WinsockSession&) = delete;
+
+	~WinsockSession()
+	{
+		WSACleanup();
+	}
+};
+
+
+class Socket
+{
+	SOCKET handle;
+
+	static sockaddr_in Loopback(unsigned short port)
+	{
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		return address;
+	}
+
+public:
+	Socket(SOCKET handle = INVALID_SOCKET) : handle(handle)
+	{ }
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	Socket(Socket&& other) : handle(other.handle)
+	{
+		other.handle = INVALID_SOCKET;
+	}
+
+	Socket& operator=(Socket&& other)
+	{
+		std::swap(handle, other.handle);
+		return *this;
+	}
+
+	~Socket()
+	{
+		if (handle != INVALID_SOCKET)
+			closesocket(handle);
+	}
+
+	static Socket Listen(unsigned short port)
+	{
+		Socket result(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+		sockaddr_in address = Loopback(port);
+		if (result.handle == INVALID_SOCKET
+			|| bind(result.handle, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR
+			|| listen(result.handle, SOMAXCONN) == SOCKET_ERROR)
+			throw std::runtime_error("cannot listen on port " + std::to_string(port));
+		return result;
+	}
+
+	static Socket Connect(unsigned short port)
+	{
+		Socket result(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+		sockaddr_in address = Loopback(port);
+		if (result.handle == INVALID_SOCKET
+			|| connect(result.handle, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR)
+			throw std::runtime_error("cannot connect to port " + std::to_string(port));
+		BOOL nodelay = TRUE;
+		setsockopt(result.handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		return result;
+	}
+
+	Socket Accept() const
+	{
+		Socket result(accept(handle, nullptr, nullptr));
+		if (result.handle == INVALID_SOCKET)
+			throw std::runtime_error("accept failed");
+		BOOL nodelay = TRUE;
+		setsockopt(result.handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		return result;
+	}
+
+	bool Send(const void* data, int size) const
+	{
+		const char* ptr = (const char*)data;
+		while (size > 0)
+		{
+			int sent = send(handle, ptr, size, 0);
+			if (sent <= 0)
+				return false;
+			ptr += sent;
+			size -= sent;
+		}
+		return true;
+	}
+
+	bool Receive(void* data, int size) const
+	{
+		char* ptr = (char*)data;
+		while (size > 0)
+		{
+			int received = recv(handle, ptr, size, 0);
+			if (received <= 0)
+				return false;
+			ptr += received;
+			size -= received;
+		}
+		return true;
+	}
+
+	SOCKET get() const
+	{
+		return handle;
+	}
+};
+
+
+class TileCoordinator
+{
+	using clock = std::chrono::steady_clock;
+
+	struct Worker
+	{
+		Socket connection;
+		int tile;
+		int frame;
+		bool alive;
+	};
+
+	Socket listener;
+	std::vector<Worker> workers;
+	std::vector<Color> pixels;
+	int frame;
+
+public:
+	TileCoordinator(unsigned short port) :
+		listener(Socket::Listen(port)),
+		frame(0)
+	{ }
+
+	int Accept(int count, int timeout_ms)
+	{
+		clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+		int accepted = 0;
+		while (accepted < count)
+		{
+			long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count();
+			if (remaining <= 0)
+				break;
+			WSAPOLLFD poll = { listener.get(), POLLRDNORM, 0 };
+			int ready = WSAPoll(&poll, 1, (INT)remaining);
+			if (ready == SOCKET_ERROR)
+				throw std::runtime_error("poll failed");
+			if (ready == 0)
+				break;
+			workers.push_back({ listener.Accept(), -1, -1, true });
+			++accepted;
+		}
+		return accepted;
+	}
+
+	void Render(const std::vector<Tile>& tiles, FrameBuffer& out)
+	{
+		++frame;
+		std::deque<int> pending;
+		for (int i = 0; i < (int)tiles.size(); ++i)
+			pending.push_back(i);
+		std::vector<bool> done(tiles.size(), false);
+		std::vector<clock::time_point> issued(tiles.size());
+		int remaining = (int)tiles.size();
+
+		auto issue = [&](Worker& worker) {
+			int tile = -1;
+			if (!pending.empty())
+			{
+				tile = pending.front();
+				pending.pop_front();
+			}
+			else
+			{
+				for (const Worker& other : workers)
+					if (other.alive && other.frame == frame && other.tile >= 0 && !done[other.tile]
+						&& (tile < 0 || issued[other.tile] < issued[tile]))
+						tile = other.tile;
+				if (tile < 0)
+					return;
+			}
+			TileMessage message{ frame, tiles[tile] };
+			if (!worker.connection.Send(&message, sizeof(message)))
+			{
+				worker.alive = false;
+				pending.push_front(tile);
+				return;
+			}
+			worker.tile = tile;
+			worker.frame = frame;
+			issued[tile] = clock::now();
+		};
+
+		for (Worker& worker : workers)
+			if (worker.alive && worker.tile < 0)
+				issue(worker);
+
+		std::vector<WSAPOLLFD> polls;
+		std::vector<Worker*> polled;
+		while (remaining > 0)
+		{
+			polls.clear();
+			polled.clear();
+			for (Worker& worker : workers)
+				if (worker.alive && worker.tile >= 0)
+				{
+					polls.push_back({ worker.connection.get(), POLLRDNORM, 0 });
+					polled.push_back(&worker);
+				}
+			if (polls.empty())
+				throw std::runtime_error("no render workers left");
+			if (WSAPoll(polls.data(), (ULONG)polls.size(), -1) == SOCKET_ERROR)
+				throw std::runtime_error("poll failed");
+
+			for (size_t k = 0; k < polls.size(); ++k)
+			{
+				Worker& worker = *polled[k];
+				if (!worker.alive || worker.tile < 0 || !(polls[k].revents & (POLLRDNORM | POLLHUP | POLLERR)))
+					continue;
+
+				TileMessage message;
+				bool received = worker.connection.Receive(&message, sizeof(message));
+				if (received)
+				{
+					pixels.resize(message.tile.width * message.tile.height);
+					received = worker.connection.Receive(pixels.data(), (int)(pixels.size() * sizeof(Color)));
+				}
+				if (!received)
+				{
+					worker.alive = false;
+					if (worker.frame == frame && !done[worker.tile])
+						pending.push_front(worker.tile);
+					for (Worker& idle : workers)
+						if (idle.alive && idle.tile < 0)
+							issue(idle);
+					continue;
+				}
+
+				if (message.frame == frame && !done[worker.tile])
+				{
+					const Tile& tile = message.tile;
+					for (int y = 0; y < tile.height; ++y)
+						for (int x = 0; x < tile.width; ++x)
+							out.at(tile.x + x, tile.y + y) = pixels[x + y * tile.width];
+					done[worker.tile] = true;
+					--remaining;
+				}
+				worker.tile = -1;
+				if (remaining > 0)
+					issue(worker);
+			}
+		}
+	}
+
+	void Shutdown()
+	{
+		TileMessage message{ -1, { 0, 0, 0, 0 } };
+		for (Worker& worker : workers)
+			if (worker.alive)
+				worker.connection.Send(&message, sizeof(message));
+		workers.clear();
+	}
+
+	~TileCoordinator()
+	{
+		Shutdown();
+	}
+};
+
+
+class TileWorker
+{
+	Socket connection;
+
+public:
+	TileWorker(unsigned short port) : connection(Socket::Connect(port))
+	{ }
+
+	void Run(std::function<Color(int, int)> render)
+	{
+		std::vector<Color> pixels;
+		TileMessage message;
+		while (connection.Receive(&message, sizeof(message)) && message.tile.width > 0)
+		{
+			const Tile& tile = message.tile;
+			pixels.resize(tile.width * tile.height);
+			for (int y = 0; y < tile.height; ++y)
+				for (int x = 0; x < tile.width; ++x)
+					pixels[x + y * tile.width] = render(tile.x + x, tile.y + y);
+			if (!connection.Send(&message, sizeof(message))
+				|| !connection.Send(pixels.data(), (int)(pixels.size() * sizeof(Color))))
+				return;
+		}
+	}
+};
+
+
+inline std::vector<Tile> SplitTiles(int width, int height, int size)
+{
+	std::vector<Tile> tiles;
+	for (int y = 0; y < height; y += size)
+		for (int x = 0; x < width; x += size)
+			tiles.push_back({ x, y, min(size, width - x), min(size, height - y) });
+	return tiles;
+}
+
+
+inline bool SpawnProcess(const std::string& arguments)
+{
+	char path[MAX_PATH];
+	GetModuleFileNameA(nullptr, path, MAX_PATH);
+	std::string command = "\"" + std::string(path) + "\" " + arguments;
+
+	STARTUPINFOA startup = {};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION process = {};
+	if (!CreateProcessA(nullptr, &command[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process))
+		return false;
+	CloseHandle(process.hThread);
+	CloseHandle(process.hProcess);
+	return true;
+}
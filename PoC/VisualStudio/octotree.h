@@ -3,8 +3,15 @@
 #include "base.h"
 #include "random.h"
 #include <Windows.h>
+#include <xmmintrin.h>
+#include <algorithm>
+#include <array>
 #include <stdexcept>
 #include <stdio.h>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <thread>
 #include <vector>
 
 
@@ -20,6 +27,23 @@ struct Material
 
 extern std::vector<Material> materialTable;
 
+
+struct MaterialSummary
+{
+	Color color;
+	Color emission;
+	float occupancy;
+	int material;
+
+	static MaterialSummary fromMaterial(int index)
+	{
+		const Material& material = materialTable[index];
+		if (index == 0)
+			return { {0, 0, 0}, {0, 0, 0}, 0, 0 };
+		return { material.color, material.light ? material.color : Color{0, 0, 0}, 1, index };
+	}
+};
+
 template <size_t Dimension>
 struct Ray
 {
@@ -28,6 +52,88 @@ struct Ray
 };
 
 
+template <size_t Dimension>
+struct Hit
+{
+	fPoint<Dimension> point;
+	IndexPoint<Dimension> voxel;
+	iVector<Dimension> normal;
+	int material;
+	float t;
+};
+
+
+template <size_t Dimension>
+struct HitRecords
+{
+	fPoint<Dimension>* point;
+	IndexPoint<Dimension>* voxel;
+	iVector<Dimension>* normal;
+	int* material;
+	float* t;
+};
+
+
+enum class CsgOperation
+{
+	Union,
+	Intersection,
+	Subtraction,
+	Overwrite
+};
+
+
+struct TreeStats
+{
+	std::vector<long long> nodes;
+	std::vector<long long> leaves;
+	std::vector<long long> volume;
+	size_t bytes;
+
+	TreeStats(int depth = 0) :
+		nodes(depth, 0),
+		leaves(depth, 0),
+		bytes(0)
+	{ }
+
+	void addLeaf(int depth, int material, long long size, int sign)
+	{
+		leaves[depth] += sign;
+		if (material >= (int)volume.size())
+			volume.resize(material + 1, 0);
+		volume[material] += sign * size;
+	}
+
+	long long totalNodes() const
+	{
+		long long total = 0;
+		for (long long count : nodes)
+			total += count;
+		return total;
+	}
+
+	long long totalLeaves() const
+	{
+		long long total = 0;
+		for (long long count : leaves)
+			total += count;
+		return total;
+	}
+
+	double branching() const
+	{
+		long long inner = totalNodes() - (nodes.empty() ? 0 : nodes[0]);
+		return inner > 0 ? (double)(totalNodes() - 1) / inner : 0;
+	}
+
+	double collapseRatio() const
+	{
+		long long total = totalLeaves();
+		return total > 0 ? (double)(total - leaves[0]) / total : 0;
+	}
+};
+
+
 template <size_t Dimension, size_t Depth>
 class OctoTree
 {
@@ -41,25 +147,141 @@ class OctoTree
 		int m;
 		float t;
 		int side;
+		Color color;
+		Color emission;
+
+		static Intersetcion Leaf(int m, float t, int side)
+		{
+			const Material& material = materialTable[m];
+			if (material.light)
+				return { m, t, side, { 0, 0, 0 }, material.color };
+			return { m, t, side, material.color, { 0, 0, 0 } };
+		}
+	};
+
+	struct PointQuery
+	{
+		unsigned long long key;
+		int index;
+
+		index_p child(int depth) const
+		{
+			index_p result;
+			for (int i = 0; i < Dimension; ++i)
+				result[i] = (key >> (depth * Dimension + Dimension - 1 - i)) & 1;
+			return result;
+		}
+
+		bool operator<(const PointQuery& q) const
+		{
+			return key < q.key;
+		}
 	};
 
+	static unsigned long long Spread(int v)
+	{
+		static const std::array<unsigned long long, 256> table = [] {
+			std::array<unsigned long long, 256> result{};
+			for (int byte = 0; byte < 256; ++byte)
+				for (int bit = 0; bit < 8; ++bit)
+					if ((byte >> bit) & 1)
+						result[byte] |= 1ull << (bit * Dimension);
+			return result;
+		}();
+
+		unsigned long long result = 0;
+		for (int byte = 0; byte * 8 < (int)Depth; ++byte)
+			result |= table[(v >> (byte * 8)) & 255] << (byte * 8 * Dimension);
+		return result;
+	}
+
+	static unsigned long long MortonKey(const index_p& p)
+	{
+		static_assert(Dimension * Depth <= 64, "Morton key does not fit in 64 bits");
+		unsigned long long key = 0;
+		for (int i = 0; i < Dimension; ++i)
+			key |= Spread(p[i]) << (Dimension - 1 - i);
+		return key;
+	}
+
+	static const PointQuery* GroupEnd(const PointQuery* begin, const PointQuery* end, int depth)
+	{
+		unsigned long long bound = ((begin->key >> (depth * Dimension)) + 1) << (depth * Dimension);
+		return std::lower_bound(begin + 1, end, PointQuery{ bound, 0 });
+	}
+
+	static std::vector<PointQuery> SortQueries(const index_p* points, int count)
+	{
+		std::vector<PointQuery> queries(count);
+		for (int i = 0; i < count; ++i)
+			queries[i] = { MortonKey(points[i]), i };
+		if (std::is_sorted(queries.begin(), queries.end()))
+			return queries;
+
+		constexpr int Radix = 8;
+		constexpr int Mask = (1 << Radix) - 1;
+		std::vector<PointQuery> buffer(count);
+		for (int shift = 0; shift < (int)(Depth * Dimension); shift += Radix)
+		{
+			std::vector<int> offset(Mask + 2, 0);
+			for (const PointQuery& q : queries)
+				++offset[((q.key >> shift) & Mask) + 1];
+			for (int i = 1; i <= Mask + 1; ++i)
+				offset[i] += offset[i - 1];
+			for (const PointQuery& q : queries)
+				buffer[offset[(q.key >> shift) & Mask]++] = q;
+			queries.swap(buffer);
+		}
+		return queries;
+	}
+
 	template <int Dim>
-	int MinIndex(int min, const f_point& p)
+	int MinIndex(int min, const f_point& p) const
 	{
 		return MinIndex<Dim - 1>(p[Dim] < p[min] ? Dim : min, p);
 	}
 
 	template <>
-	int MinIndex<-1>(int min, const f_point& p)
+	int MinIndex<-1>(int min, const f_point& p) const
 	{
 		return min;
 	}
 
-	int MinIndex(const f_point& p)
+	int MinIndex(const f_point& p) const
 	{
 		return MinIndex<Dimension - 2>(Dimension - 1, p);
 	}
 
+	template <typename FaceFn>
+	static void Faces(const std::vector<int>& cells, int low, int high, int axis, FaceFn& face)
+	{
+		if (low >= 0 && high >= 0)
+		{
+			face(low, high, axis);
+			return;
+		}
+		for (int i = 0; i < (1 << Dimension); ++i)
+		{
+			if ((i >> axis) & 1)
+				continue;
+			int j = i | (1 << axis);
+			Faces(cells, low < 0 ? cells[(~low << Dimension) + j] : low, high < 0 ? cells[(~high << Dimension) + i] : high, axis, face);
+		}
+	}
+
+	template <typename FaceFn>
+	static void Adjacency(const std::vector<int>& cells, int node, FaceFn& face)
+	{
+		int base = node << Dimension;
+		for (int i = 0; i < (1 << Dimension); ++i)
+			if (cells[base + i] < 0)
+				Adjacency(cells, ~cells[base + i], face);
+		for (int axis = 0; axis < Dimension; ++axis)
+			for (int i = 0; i < (1 << Dimension); ++i)
+				if (!((i >> axis) & 1))
+					Faces(cells, cells[base + i], cells[base + (i | (1 << axis))], axis, face);
+	}
+
 	struct Node
 	{
 		static constexpr bool isPointer(Node* ptr)
@@ -78,6 +300,35 @@ class OctoTree
 			return index_p::all(2, [&](const index_p& i) { return data[i] == monomaterial; });
 		}
 
+		static MaterialSummary summaryOf(Node* node)
+		{
+			return isPointer(node) ? node->summary : MaterialSummary::fromMaterial(extractIndex(node));
+		}
+
+		void Summarize()
+		{
+			MaterialSummary result{ {0, 0, 0}, {0, 0, 0}, 0, 0 };
+			float weight = 0;
+			index_p::forEach(2, [&](const index_p& i) {
+				MaterialSummary child = summaryOf(data[i]);
+				result.color += child.color * child.occupancy;
+				result.emission += child.emission;
+				result.occupancy += child.occupancy;
+				if (child.occupancy > weight)
+				{
+					weight = child.occupancy;
+					result.material = child.material;
+				}
+			});
+
+			constexpr float count = 1 << Dimension;
+			if (result.occupancy > 0)
+				result.color = result.color / result.occupancy;
+			result.emission = result.emission / count;
+			result.occupancy /= count;
+			summary = result;
+		}
+
 		static constexpr int extractIndex(Node* ptr)
 		{
 			return (int)(((unsigned long long)ptr) >> 1);
@@ -88,13 +339,26 @@ class OctoTree
 			return (Node*)((index << 1) | 1);
 		}
 
-		bool _setMaterial(index_p p, Node* material, int depth)
+		bool Refresh(bool defer)
+		{
+			Summarize();
+			if (defer)
+			{
+				dirty = true;
+				return false;
+			}
+			return isMonomaterial();
+		}
+
+		bool _setMaterial(index_p p, Node* material, int depth, int level, bool defer)
 		{
 			Node*& node = data[p >> depth];
-			if (depth == 0)
+			if (depth == level)
 			{
+				if (isPointer(node))
+					delete node;
 				node = material;
-				return isMonomaterial();
+				return Refresh(defer);
 			}
 
 			if (!isPointer(node))
@@ -105,13 +369,42 @@ class OctoTree
 			}
 
 			int mask = ~((-1) << depth);
-			bool node_monomaterial = node->_setMaterial(p & mask, material, depth - 1);
+			bool node_monomaterial = node->_setMaterial(p & mask, material, depth - 1, level, defer);
 			if (node_monomaterial)
 			{
 				Node* monomaterial = node->getMonomaterial();
 				delete node;
 				node = monomaterial;
 			}
+			return Refresh(defer);
+		}
+
+		bool _optimize(bool parallel)
+		{
+			NDimensionalMatrix<bool, Dimension, 2> uniform(false);
+			std::vector<std::thread> workers;
+			index_p::forEach(2, [&](const index_p& i) {
+				Node* node = data[i];
+				if (!isPointer(node) || !node->dirty)
+					return;
+				if (parallel)
+					workers.emplace_back([node, i, &uniform] { uniform[i] = node->_optimize(false); });
+				else
+					uniform[i] = node->_optimize(false);
+			});
+			for (std::thread& worker : workers)
+				worker.join();
+
+			index_p::forEach(2, [&](const index_p& i) {
+				if (!uniform[i])
+					return;
+				Node*& node = data[i];
+				Node* monomaterial = node->getMonomaterial();
+				delete node;
+				node = monomaterial;
+			});
+			dirty = false;
+			Summarize();
 			return isMonomaterial();
 		}
 
@@ -124,22 +417,384 @@ class OctoTree
 			return node->_getMaterial(p & mask, depth - 1);
 		}
 
+		int _getRegion(index_p p, int depth, int level) const
+		{
+			Node* node = data[p >> depth];
+			if (!isPointer(node))
+				return extractIndex(node);
+			if (depth == level)
+				return -1;
+			int mask = ~((-1) << depth);
+			return node->_getRegion(p & mask, depth - 1, level);
+		}
+
+		void _getMaterials(const PointQuery* begin, const PointQuery* end, int depth, int* out) const
+		{
+			while (begin != end)
+			{
+				const PointQuery* group = GroupEnd(begin, end, depth);
+				if (group != end)
+					_mm_prefetch((const char*)data[group->child(depth)], _MM_HINT_T0);
+
+				Node* node = data[begin->child(depth)];
+				if (!isPointer(node))
+					for (const PointQuery* q = begin; q != group; ++q)
+						out[q->index] = extractIndex(node);
+				else
+					node->_getMaterials(begin, group, depth - 1, out);
+				begin = group;
+			}
+		}
+
+		bool _setMaterials(const PointQuery* begin, const PointQuery* end, int depth, const int* materials, bool defer)
+		{
+			while (begin != end)
+			{
+				const PointQuery* group = GroupEnd(begin, end, depth);
+				Node*& node = data[begin->child(depth)];
+				if (depth == 0)
+					node = injectIndex(materials[(group - 1)->index]);
+				else
+				{
+					if (!isPointer(node))
+					{
+						bool unchanged = std::all_of(begin, group, [&](const PointQuery& q) {
+							return injectIndex(materials[q.index]) == node;
+						});
+						if (!unchanged)
+							node = new Node(node);
+					}
+					if (isPointer(node) && node->_setMaterials(begin, group, depth - 1, materials, defer))
+					{
+						Node* monomaterial = node->getMonomaterial();
+						delete node;
+						node = monomaterial;
+					}
+				}
+				begin = group;
+			}
+			return Refresh(defer);
+		}
+
+		void _save(std::ostream& out) const
+		{
+			index_p::forEach(2, [&](const index_p& i) {
+				Node* node = data[i];
+				int tag = isPointer(node) ? -1 : extractIndex(node);
+				out.write((const char*)&tag, sizeof(tag));
+				if (isPointer(node))
+					node->_save(out);
+			});
+		}
+
+		void _load(std::istream& in, int depth)
+		{
+			index_p::forEach(2, [&](const index_p& i) {
+				Node*& node = data[i];
+				int tag;
+				if (!in.read((char*)&tag, sizeof(tag)))
+					throw std::runtime_error("unexpected end of voxel stream");
+				if (tag < -1 || tag >= (int)materialTable.size())
+					throw std::runtime_error("voxel stream references an unknown material");
+				if (tag >= 0)
+					node = injectIndex(tag);
+				else if (depth > 0)
+				{
+					node = new Node();
+					node->_load(in, depth - 1);
+				}
+				else
+					throw std::runtime_error("voxel stream is deeper than the tree");
+			});
+			dirty = false;
+			Summarize();
+		}
+
+		void _swap(Node& other)
+		{
+			index_p::forEach(2, [&](const index_p& i) { std::swap(data[i], other.data[i]); });
+			std::swap(summary, other.summary);
+			std::swap(dirty, other.dirty);
+		}
+
+		template <typename Source>
+		static Node* _build(const Source& source, const index_p& origin, int depth)
+		{
+			NDimensionalMatrix<Node*, Dimension, 2> children;
+			index_p::forEach(2, [&](const index_p& i) {
+				index_p corner = origin;
+				for (int d = 0; d < Dimension; ++d)
+					corner[d] += i[d] << depth;
+				children[i] = depth == 0 ? injectIndex(source(corner)) : _build(source, corner, depth - 1);
+			});
+
+			Node* first = children[index_p(0)];
+			if (!isPointer(first) && index_p::all(2, [&](const index_p& i) { return children[i] == first; }))
+				return first;
+
+			Node* node = new Node();
+			index_p::forEach(2, [&](const index_p& i) { node->data[i] = children[i]; });
+			node->Summarize();
+			return node;
+		}
+
+		template <typename Source>
+		void _fill(const Source& source, int depth)
+		{
+			std::vector<std::thread> workers;
+			index_p::forEach(2, [&](const index_p& i) {
+				Node*& node = data[i];
+				if (isPointer(node))
+					delete node;
+				index_p corner = i << depth;
+				if (depth == 0)
+					node = injectIndex(source(corner));
+				else
+					workers.emplace_back([&source, &node, corner, depth] { node = _build(source, corner, depth - 1); });
+			});
+			for (std::thread& worker : workers)
+				worker.join();
+			dirty = false;
+			Summarize();
+		}
+
+		static int Combine(int a, int b, CsgOperation operation)
+		{
+			switch (operation)
+			{
+			case CsgOperation::Union:
+				return a != 0 ? a : b;
+			case CsgOperation::Intersection:
+				return a != 0 && b != 0 ? a : 0;
+			case CsgOperation::Subtraction:
+				return b != 0 ? 0 : a;
+			default:
+				return b != 0 ? b : a;
+			}
+		}
+
+		static Node* _clone(Node* node)
+		{
+			if (!isPointer(node))
+				return node;
+			Node* result = new Node();
+			index_p::forEach(2, [&](const index_p& i) { result->data[i] = _clone(node->data[i]); });
+			result->summary = node->summary;
+			result->dirty = node->dirty;
+			return result;
+		}
+
+		static Node* _combine(Node* a, Node* b, CsgOperation operation)
+		{
+			if (!isPointer(b))
+			{
+				int mb = extractIndex(b);
+				if (!isPointer(a))
+					return injectIndex(Combine(extractIndex(a), mb, operation));
+				if (Combine(1, mb, operation) == 0 && Combine(0, mb, operation) == 0)
+				{
+					delete a;
+					return injectIndex(0);
+				}
+				if (Combine(1, mb, operation) == 1 && Combine(0, mb, operation) == 0)
+					return a;
+				if (operation == CsgOperation::Overwrite)
+				{
+					delete a;
+					return b;
+				}
+			}
+			else if (!isPointer(a))
+			{
+				int ma = extractIndex(a);
+				if (ma == 0 && (operation == CsgOperation::Intersection || operation == CsgOperation::Subtraction))
+					return a;
+				if (ma != 0 && operation == CsgOperation::Union)
+					return a;
+				if (ma == 0)
+					return _clone(b);
+				a = new Node(a);
+			}
+
+			index_p::forEach(2, [&](const index_p& i) {
+				a->data[i] = _combine(a->data[i], isPointer(b) ? b->data[i] : b, operation);
+			});
+			a->Summarize();
+			if (!a->isMonomaterial())
+				return a;
+			Node* monomaterial = a->getMonomaterial();
+			delete a;
+			return monomaterial;
+		}
+
+		void _combineRoot(const Node& other, CsgOperation operation)
+		{
+			std::vector<std::thread> workers;
+			index_p::forEach(2, [&](const index_p& i) {
+				Node*& node = data[i];
+				Node* source = other.data[i];
+				if (isPointer(node) || isPointer(source))
+					workers.emplace_back([&node, source, operation] { node = _combine(node, source, operation); });
+				else
+					node = _combine(node, source, operation);
+			});
+			for (std::thread& worker : workers)
+				worker.join();
+			Summarize();
+		}
+
+		void _bounds(const index_p& origin, int depth, index_p& lo, index_p& hi) const
+		{
+			index_p::forEach(2, [&](const index_p& i) {
+				Node* node = data[i];
+				if (node == injectIndex(0))
+					return;
+				index_p corner = origin;
+				for (int d = 0; d < Dimension; ++d)
+					corner[d] += i[d] << depth;
+				if (isPointer(node))
+				{
+					node->_bounds(corner, depth - 1, lo, hi);
+					return;
+				}
+				for (int d = 0; d < Dimension; ++d)
+				{
+					lo[d] = min(lo[d], corner[d]);
+					hi[d] = max(hi[d], corner[d] + (1 << depth));
+				}
+			});
+		}
+
+		void _account(TreeStats& stats, int depth, int sign) const
+		{
+			stats.nodes[depth] += sign;
+			index_p::forEach(2, [&](const index_p& i) {
+				Node* node = data[i];
+				if (!isPointer(node))
+					stats.addLeaf(depth, extractIndex(node), 1ll << (depth * Dimension), sign);
+			});
+		}
+
+		void _stats(TreeStats& stats, int depth, int sign) const
+		{
+			_account(stats, depth, sign);
+			index_p::forEach(2, [&](const index_p& i) {
+				Node* node = data[i];
+				if (isPointer(node))
+					node->_stats(stats, depth - 1, sign);
+			});
+		}
+
+		void _accountRegion(index_p p, int depth, int level, TreeStats& stats, int sign) const
+		{
+			_account(stats, depth, sign);
+			Node* node = data[p >> depth];
+			if (!isPointer(node))
+				return;
+			int mask = ~((-1) << depth);
+			if (depth == level)
+				node->_stats(stats, depth - 1, sign);
+			else
+				node->_accountRegion(p & mask, depth - 1, level, stats, sign);
+		}
+
+		void _accountQueries(const PointQuery* begin, const PointQuery* end, int depth, TreeStats& stats, int sign) const
+		{
+			_account(stats, depth, sign);
+			while (begin != end)
+			{
+				const PointQuery* group = GroupEnd(begin, end, depth);
+				Node* node = data[begin->child(depth)];
+				if (isPointer(node))
+					node->_accountQueries(begin, group, depth - 1, stats, sign);
+				begin = group;
+			}
+		}
+
+		template <typename CellFn>
+		void _cells(const index_p& origin, int depth, std::vector<int>& cells, int& leaves, CellFn& cell) const
+		{
+			int base = (int)cells.size();
+			cells.resize(base + (1 << Dimension));
+			index_p::forEach(2, [&](const index_p& i) {
+				int slot = base;
+				index_p corner = origin;
+				for (int d = 0; d < Dimension; ++d)
+				{
+					slot += i[d] << d;
+					corner[d] += i[d] << depth;
+				}
+				Node* node = data[i];
+				if (isPointer(node))
+				{
+					cells[slot] = ~(int)(cells.size() >> Dimension);
+					node->_cells(corner, depth - 1, cells, leaves, cell);
+				}
+				else
+				{
+					cells[slot] = leaves++;
+					cell(corner, depth, extractIndex(node));
+				}
+			});
+		}
+
+		void _block(const index_p& origin, int depth, const index_p& lo, const index_p& hi, int* out) const
+		{
+			index_p::forEach(2, [&](const index_p& i) {
+				index_p corner = origin;
+				for (int d = 0; d < Dimension; ++d)
+					corner[d] += i[d] << depth;
+				index_p a = index_p::Max(corner, lo);
+				index_p b = index_p::Min(corner + i_vector(1 << depth), hi);
+				for (int d = 0; d < Dimension; ++d)
+					if (a[d] >= b[d])
+						return;
+
+				Node* node = data[i];
+				if (isPointer(node))
+				{
+					node->_block(corner, depth - 1, lo, hi, out);
+					return;
+				}
+				int material = extractIndex(node);
+				index_p::forEach(a, b, [&](const index_p& p) {
+					size_t offset = 0;
+					for (int d = Dimension - 1; d >= 0; --d)
+						offset = offset * (hi[d] - lo[d]) + (p[d] - lo[d]);
+					out[offset] = material;
+				});
+			});
+		}
+
+		MaterialSummary _getSummary(index_p p, int depth, int level) const
+		{
+			Node* node = data[p >> depth];
+			if (!isPointer(node))
+				return MaterialSummary::fromMaterial(extractIndex(node));
+			if (depth == level)
+				return node->summary;
+			int mask = ~((-1) << depth);
+			return node->_getSummary(p & mask, depth - 1, level);
+		}
+
 		Node(const Node&) = delete;
 		Node(Node&&) = delete;
 		Node& operator=(const Node&) = delete;
 		Node& operator=(Node&&) = delete;
 
-		Node(Node* material) : data(material)
+		Node(Node* material) : data(material), summary(summaryOf(material)), dirty(false)
 		{ }
 
 		NDimensionalMatrix<Node*, Dimension, 2> data;
+		MaterialSummary summary;
+		bool dirty;
 
 		Node(): Node((Node*)1)
 		{ }
 
-		void setMaterial(index_p p, int index, int depth)
+		void setMaterial(index_p p, int index, int depth, bool defer)
 		{
-			_setMaterial(p, injectIndex(index), depth);
+			_setMaterial(p, injectIndex(index), depth, 0, defer);
 		}
 
 		int getMaterial(index_p p, int depth) const
@@ -157,80 +812,317 @@ class OctoTree
 		}
 	};
 
+	struct DistanceField
+	{
+		static constexpr int BrickDepth = Depth > 3 ? 3 : 0;
+		static constexpr int Bricks = 1 << (Depth - BrickDepth);
+		static constexpr int Radius = 4;
+
+		NDimensionalMatrix<unsigned char, Dimension, Bricks> data;
+
+		void Recompute(const index_p& lo, const index_p& hi)
+		{
+			index_p from = index_p::Max(lo - i_vector(Radius), 0);
+			index_p to = index_p::Min(hi + i_vector(Radius), Bricks);
+			i_vector extent = to - from;
+			auto offset = [&](const index_p& p) {
+				int result = 0;
+				for (int i = Dimension - 1; i >= 0; --i)
+					result = result * extent[i] + p[i] - from[i];
+				return result;
+			};
+
+			int volume = 1;
+			for (int i = 0; i < Dimension; ++i)
+				volume *= extent[i];
+			std::vector<unsigned char> src(volume), dst(volume);
+			index_p::forEach(from, to, [&](const index_p& p) {
+				src[offset(p)] = data[p] == 0 ? 0 : Radius;
+			});
+
+			for (int axis = 0; axis < Dimension; ++axis)
+			{
+				index_p::forEach(from, to, [&](const index_p& p) {
+					int best = src[offset(p)];
+					index_p q = p;
+					for (int k = 1; k < best; ++k)
+					{
+						q[axis] = p[axis] - k;
+						if (q[axis] >= from[axis])
+							best = min(best, max(k, (int)src[offset(q)]));
+						q[axis] = p[axis] + k;
+						if (q[axis] < to[axis])
+							best = min(best, max(k, (int)src[offset(q)]));
+					}
+					dst[offset(p)] = best;
+				});
+				std::swap(src, dst);
+			}
+
+			index_p::forEach(lo, hi, [&](const index_p& p) {
+				data[p] = src[offset(p)];
+			});
+		}
+
+		void Update(const index_p& brick, bool occupied)
+		{
+			if (occupied == (data[brick] == 0))
+				return;
+			data[brick] = occupied ? 0 : Radius;
+			Recompute(index_p::Max(brick - i_vector(Radius - 1), 0),
+				index_p::Min(brick + i_vector(Radius), Bricks));
+		}
+	};
+
+	struct Traversal
+	{
+		index_p pos, step;
+		f_point next, len;
+		int level;
+		int side;
+		float t;
+
+		Traversal(const Ray<Dimension>& ray) : level(0), side(0), t(0)
+		{
+			for (int i = 0; i < Dimension; ++i)
+			{
+				pos[i] = min(max((int)ray.point[i], 0), (1 << Depth) - 1);
+				step[i] = ray.vector[i] > 0 ? 1 : -1;
+				len[i] = std::abs(1 / ray.vector[i]);
+				next[i] = len[i] * (ray.vector[i] > 0 ? 1 - (ray.point[i] - pos[i]) : ray.point[i] - pos[i]);
+			}
+		}
+	};
+
+	bool Leap(const Ray<Dimension>& ray, Traversal& walk) const
+	{
+		constexpr int BrickDepth = DistanceField::BrickDepth;
+		index_p brick = walk.pos >> BrickDepth;
+		int d = distance->data[brick];
+		if (d == 0)
+			return false;
+
+		index_p lo = index_p::Max((brick - i_vector(d - 1)) << BrickDepth, 0);
+		index_p hi = index_p::Min((brick + i_vector(d)) << BrickDepth, size());
+		int side = 0;
+		float t = 0;
+		for (int i = 0; i < Dimension; ++i)
+		{
+			float exit = walk.len[i] * (ray.vector[i] > 0 ? hi[i] - ray.point[i] : ray.point[i] - lo[i]);
+			if (i == 0 || exit < t)
+			{
+				t = exit;
+				side = i;
+			}
+		}
+		if (t <= walk.next[MinIndex(walk.next)])
+			return false;
+
+		for (int i = 0; i < Dimension; ++i)
+		{
+			if (i == side)
+				walk.pos[i] = ray.vector[i] > 0 ? hi[i] : lo[i] - 1;
+			else
+				walk.pos[i] = min(max((int)(ray.point[i] + ray.vector[i] * t), lo[i]), hi[i] - 1);
+			walk.next[i] = walk.len[i] * (ray.vector[i] > 0 ? walk.pos[i] + 1 - ray.point[i] : ray.point[i] - walk.pos[i]);
+		}
+		walk.side = side;
+		walk.t = t;
+		return true;
+	}
+
+	void Coarsen(const Ray<Dimension>& ray, int lod, Traversal& walk) const
+	{
+		int shift = lod - walk.level;
+		walk.pos = walk.pos >> shift;
+		for (int i = 0; i < Dimension; ++i)
+		{
+			walk.len[i] *= 1 << shift;
+			walk.next[i] = std::abs(1 / ray.vector[i]) * (ray.vector[i] > 0
+				? ((walk.pos[i] + 1) << lod) - ray.point[i]
+				: ray.point[i] - (walk.pos[i] << lod));
+		}
+		walk.level = lod;
+	}
+
+	void Refine(const Ray<Dimension>& ray, Traversal& walk) const
+	{
+		int level = walk.level - 1;
+		f_point p = ray.point + ray.vector * walk.t;
+		for (int i = 0; i < Dimension; ++i)
+		{
+			int lo = walk.pos[i] << 1;
+			walk.pos[i] = min(max((int)p[i] >> level, lo), lo + 1);
+			walk.len[i] /= 2;
+			walk.next[i] = std::abs(1 / ray.vector[i]) * (ray.vector[i] > 0
+				? ((walk.pos[i] + 1) << level) - ray.point[i]
+				: ray.point[i] - (walk.pos[i] << level));
+		}
+		walk.level = level;
+	}
+
+	bool Advance(const Ray<Dimension>& ray, Traversal& walk, bool empty) const
+	{
+		if (walk.level > 0 || !distance || !empty || !Leap(ray, walk))
+		{
+			int side = MinIndex(walk.next);
+			walk.side = side;
+			walk.t = walk.next[side];
+			walk.pos[side] += walk.step[side];
+			walk.next[side] += walk.len[side];
+		}
+		return walk.pos[walk.side] >= 0 && walk.pos[walk.side] < size() >> walk.level;
+	}
+
+	static constexpr float DiffuseCone = 0.125f;
+
 	struct TraceContext
 	{
 		Color color;
 		int depth;
+		float cone;
+		SurfaceSample* surface;
 	};
 
-	Color ProcessingMaterial(
+	template <typename Next>
+	static Color Scatter(
+		Random<Dimension>& rnd,
 		const TraceContext& ctx,
 		const Ray<Dimension>& ray,
-		const Intersetcion& inter)
+		const Intersetcion& inter,
+		const Next& next)
 	{
-		const Material& material = materialTable[inter.m];
-		if (material.light)
-			return ctx.color * material.color;
+		if (ctx.surface)
+			*ctx.surface = { ray.vector[inter.side] > 0 ? -(inter.side + 1) : inter.side + 1, inter.m, inter.t, inter.color + inter.emission };
 
+		const Material& material = materialTable[inter.m];
+		Color result = ctx.color * inter.emission;
 		if (ctx.depth > 3)
-			return { 0, 0, 0 };
+			return result;
 
 		f_point start_point = ray.point + ray.vector * (inter.t - 0.0001f);
 
-		f_vector rand_vec = rnd.direction();
-		rand_vec[inter.side] = std::abs(rand_vec[inter.side]) * (ray.vector[inter.side] > 0 ? -1 : 1);
-		Color result = Trace(
-			{ ctx.color * material.color, ctx.depth + 1 },
-			{ start_point , rand_vec });
+		if (inter.color.r > 0 || inter.color.g > 0 || inter.color.b > 0)
+		{
+			f_vector rand_vec = rnd.direction();
+			rand_vec[inter.side] = std::abs(rand_vec[inter.side]) * (ray.vector[inter.side] > 0 ? -1 : 1);
+			result = result + next(
+				{ ctx.color * inter.color, ctx.depth + 1, ctx.cone > 0 ? max(ctx.cone, DiffuseCone) : 0 },
+				{ start_point , rand_vec });
+		}
 
-		if (material.reflection > 0)
+		if (material.reflection > 0 && !material.light)
 		{
 			f_vector reflect_vector = ray.vector;
 			reflect_vector[inter.side] = -reflect_vector[inter.side];
-			result = result + Trace(
-				{ ctx.color * material.reflection, ctx.depth + 1 },
+			result = result + next(
+				{ ctx.color * material.reflection, ctx.depth + 1, ctx.cone },
 				{ start_point, reflect_vector });
 		}
 		return result;
 	}
 
+	Color ProcessingMaterial(
+		const TraceContext& ctx,
+		const Ray<Dimension>& ray,
+		const Intersetcion& inter)
+	{
+		return Scatter(rnd, ctx, ray, inter, [this](const TraceContext& bounce, const Ray<Dimension>& secondary) {
+			return Trace(bounce, secondary);
+		});
+	}
+
 	Color Trace(const TraceContext& ctx, const Ray<Dimension>& ray)
 	{
-		index_p pos, step;
-		f_point next, len;
-		for (int i = 0; i < Dimension; ++i)
+		Traversal walk(ray);
+		int material = getMaterial(walk.pos);
+		float lod_t = material == 0 && ctx.cone > 0 ? 2 / ctx.cone : INFINITY;
+		while (Advance(ray, walk, material == 0))
 		{
-			pos[i] = (int)ray.point[i];
-			step[i] = ray.vector[i] > 0 ? 1 : -1;
-			len[i] = std::abs(1 / ray.vector[i]);
-			next[i] = len[i] * (ray.vector[i] > 0 ? 1 - (ray.point[i] - pos[i]) : ray.point[i] - pos[i]);
+			if (walk.t >= lod_t)
+			{
+				int lod = walk.level;
+				while (lod < (int)Depth - 1 && (2 << lod) <= ctx.cone * walk.t)
+					++lod;
+				if (lod > walk.level)
+					Coarsen(ray, lod, walk);
+				lod_t = (2 << walk.level) / ctx.cone;
+			}
+
+			float exit = walk.next[MinIndex(walk.next)];
+			while (walk.level > 0)
+			{
+				MaterialSummary summary = getSummary(walk.pos << walk.level, walk.level);
+				if (summary.occupancy == 0)
+					break;
+				if (summary.occupancy >= 1)
+				{
+					Color emitted = summary.emission;
+					Color albedo = {
+						max(summary.color.r - emitted.r, 0.0f),
+						max(summary.color.g - emitted.g, 0.0f),
+						max(summary.color.b - emitted.b, 0.0f)
+					};
+					return ProcessingMaterial(ctx, ray, { summary.material, walk.t, walk.side, albedo, emitted });
+				}
+				Refine(ray, walk);
+				lod_t = max(lod_t, exit);
+			}
+			if (walk.level == 0)
+				if (int m = getMaterial(walk.pos); material != m)
+					return ProcessingMaterial(ctx, ray, Intersetcion::Leaf(m, walk.t, walk.side));
 		}
+		return { 0, 0, 0 };
+	}
 
-		int material = getMaterial(pos);
-		while (true)
-		{
-			int min_index = MinIndex(next);
+	Node root;
+	Random<Dimension> rnd;
+	std::unique_ptr<DistanceField> distance;
+	std::unique_ptr<TreeStats> tracked;
+	bool deferred;
 
-			pos[min_index] += step[min_index];
-			if (pos[min_index] < 0 || pos[min_index] >= size())
-				return { 0, 0, 0 };
+	TreeStats CountStats() const
+	{
+		TreeStats stats(Depth);
+		root._stats(stats, Depth - 1, 1);
+		return stats;
+	}
 
-			if (int m = getMaterial(pos); material != m)
-				return ProcessingMaterial(ctx, ray, { m, next[min_index], min_index });
+	void RecountStats()
+	{
+		if (tracked)
+			*tracked = CountStats();
+	}
 
-			next[min_index] += len[min_index] ;
-		}
+	void UpdateDistance(const index_p& p, int index)
+	{
+		if (deferred && index == 0)
+			return;
+		index_p brick = p >> DistanceField::BrickDepth;
+		distance->Update(brick, deferred || getRegion(p, DistanceField::BrickDepth) != 0);
 	}
 
-	Node root;
-	Random<Dimension> rnd;
+	void RebuildDistanceField()
+	{
+		index_p::forEach(DistanceField::Bricks, [&](const index_p& brick) {
+			distance->data[brick] = getRegion(brick << DistanceField::BrickDepth, DistanceField::BrickDepth) == 0 ? DistanceField::Radius : 0;
+		});
+		distance->Recompute(0, DistanceField::Bricks);
+	}
 
 public:
-	OctoTree(): root() {}
+	OctoTree(): root(), deferred(false) {}
 
 	void setMaterial(index_p p, int index)
 	{
-		root.setMaterial(p, index, Depth - 1);
+		PointQuery query{ tracked ? MortonKey(p) : 0, 0 };
+		if (tracked)
+			root._accountQueries(&query, &query + 1, Depth - 1, *tracked, -1);
+		root.setMaterial(p, index, Depth - 1, deferred);
+		if (tracked)
+			root._accountQueries(&query, &query + 1, Depth - 1, *tracked, 1);
+		if (distance)
+			UpdateDistance(p, index);
 	}
 
 	int getMaterial(index_p p) const
@@ -238,12 +1130,302 @@ public:
 		return root.getMaterial(p, Depth - 1);
 	}
 
+	void setRegion(index_p p, int level, int index)
+	{
+		if (level == 0)
+		{
+			setMaterial(p, index);
+			return;
+		}
+		if (tracked)
+			root._accountRegion(p, Depth - 1, level, *tracked, -1);
+		root._setMaterial(p, Node::injectIndex(index), Depth - 1, level, deferred);
+		if (tracked)
+			root._accountRegion(p, Depth - 1, level, *tracked, 1);
+
+		if (!distance)
+			return;
+		constexpr int BrickDepth = DistanceField::BrickDepth;
+		if (level <= BrickDepth)
+		{
+			UpdateDistance(p, index);
+			return;
+		}
+		index_p lo = (p >> level << level) >> BrickDepth;
+		index_p hi = lo + i_vector(1 << (level - BrickDepth));
+		index_p::forEach(lo, hi, [&](const index_p& brick) {
+			distance->data[brick] = index != 0 ? 0 : DistanceField::Radius;
+		});
+		distance->Recompute(index_p::Max(lo - i_vector(DistanceField::Radius - 1), 0),
+			index_p::Min(hi + i_vector(DistanceField::Radius - 1), DistanceField::Bricks));
+	}
+
+	template <typename CellFn, typename FaceFn>
+	void VisitCells(CellFn cell, FaceFn face) const
+	{
+		std::vector<int> cells;
+		int leaves = 0;
+		root._cells(index_p(0), Depth - 1, cells, leaves, cell);
+		Adjacency(cells, 0, face);
+	}
+
+	void getBlock(const index_p& lo, const index_p& hi, int* out) const
+	{
+		root._block(index_p(0), Depth - 1, lo, hi, out);
+	}
+
+	void getMaterials(const index_p* points, int* out, int count) const
+	{
+		std::vector<PointQuery> queries = SortQueries(points, count);
+		root._getMaterials(queries.data(), queries.data() + count, Depth - 1, out);
+	}
+
+	void setMaterials(const index_p* points, const int* materials, int count)
+	{
+		std::vector<PointQuery> queries = SortQueries(points, count);
+		if (tracked)
+			root._accountQueries(queries.data(), queries.data() + count, Depth - 1, *tracked, -1);
+		root._setMaterials(queries.data(), queries.data() + count, Depth - 1, materials, deferred);
+		if (tracked)
+			root._accountQueries(queries.data(), queries.data() + count, Depth - 1, *tracked, 1);
+		if (distance)
+		{
+			const PointQuery* end = queries.data() + count;
+			for (const PointQuery* q = queries.data(); q != end; q = deferred ? q + 1 : GroupEnd(q, end, DistanceField::BrickDepth))
+				UpdateDistance(points[q->index], materials[q->index]);
+		}
+	}
+
+	void Save(std::ostream& out) const
+	{
+		int header[] = { (int)Dimension, (int)Depth };
+		out.write((const char*)header, sizeof(header));
+		root._save(out);
+	}
+
+	void Load(std::istream& in)
+	{
+		int header[2];
+		if (!in.read((char*)header, sizeof(header)) || header[0] != Dimension || header[1] != Depth)
+			throw std::runtime_error("voxel stream does not match tree dimensions");
+		Node loaded;
+		loaded._load(in, Depth - 1);
+		root._swap(loaded);
+		deferred = false;
+		RecountStats();
+		if (distance)
+			RebuildDistanceField();
+	}
+
+	void Combine(const OctoTree& other, CsgOperation operation)
+	{
+		if (&other == this)
+		{
+			if (operation == CsgOperation::Subtraction)
+				Build([](const index_p&) { return 0; });
+			return;
+		}
+		root._combineRoot(other.root, operation);
+		RecountStats();
+		if (distance)
+			RebuildDistanceField();
+	}
+
+	template <typename Source>
+	void Build(const Source& source)
+	{
+		root._fill(source, Depth - 1);
+		RecountStats();
+		if (distance)
+			RebuildDistanceField();
+	}
+
+	void BuildDense(const int* grid)
+	{
+		Build([grid, this](const index_p& p) {
+			size_t offset = 0;
+			for (int d = Dimension - 1; d >= 0; --d)
+				offset = offset * size() + p[d];
+			return grid[offset];
+		});
+	}
+
+	void DeferCollapse()
+	{
+		deferred = true;
+	}
+
+	void Optimize()
+	{
+		if (!deferred)
+			return;
+		root._optimize(true);
+		deferred = false;
+		RecountStats();
+		if (distance)
+			RebuildDistanceField();
+	}
+
+	bool OccupiedBounds(index_p& lo, index_p& hi) const
+	{
+		lo = index_p(size());
+		hi = index_p(0);
+		root._bounds(index_p(0), Depth - 1, lo, hi);
+		return lo[0] < hi[0];
+	}
+
+	int getRegion(index_p p, int level) const
+	{
+		return root._getRegion(p, Depth - 1, level);
+	}
+
+	MaterialSummary getSummary(index_p p, int level) const
+	{
+		return root._getSummary(p, Depth - 1, level);
+	}
+
+	void TrackStats()
+	{
+		tracked.reset(new TreeStats(CountStats()));
+	}
+
+	void UntrackStats()
+	{
+		tracked.reset();
+	}
+
+	TreeStats Stats() const
+	{
+		TreeStats stats = tracked ? *tracked : CountStats();
+		stats.bytes = sizeof(*this) + stats.totalNodes() * sizeof(Node) + (distance ? sizeof(DistanceField) : 0);
+		return stats;
+	}
+
+	void MemoryReport(std::ostream& out) const
+	{
+		TreeStats stats = Stats();
+		out << "bytes: " << stats.bytes << ", nodes: " << stats.totalNodes() << ", leaves: " << stats.totalLeaves() << std::endl;
+		out << "branching: " << stats.branching() << ", collapsed: " << stats.collapseRatio() << std::endl;
+		for (int depth = Depth - 1; depth >= 0; --depth)
+			out << "depth " << depth << ": nodes " << stats.nodes[depth] << ", leaves " << stats.leaves[depth] << std::endl;
+		for (int material = 0; material < (int)stats.volume.size(); ++material)
+			if (stats.volume[material] > 0)
+				out << "material " << material << ": " << stats.volume[material] << " voxels" << std::endl;
+	}
+
+	void EnableDistanceField()
+	{
+		distance.reset(new DistanceField());
+		RebuildDistanceField();
+	}
+
+	void DisableDistanceField()
+	{
+		distance.reset();
+	}
+
 	Color Trace(Ray<Dimension> ray)
 	{
-		TraceContext ctx{ {1, 1, 1}, 0 };
+		TraceContext ctx{ {1, 1, 1}, 0, 0, nullptr };
+		return Trace(ctx, ray);
+	}
+
+	Color Trace(Ray<Dimension> ray, float cone)
+	{
+		TraceContext ctx{ {1, 1, 1}, 0, cone, nullptr };
+		return Trace(ctx, ray);
+	}
+
+	Color Trace(Ray<Dimension> ray, float cone, SurfaceSample& surface)
+	{
+		surface = { 0, -1, INFINITY, { 0, 0, 0 } };
+		TraceContext ctx{ {1, 1, 1}, 0, cone, &surface };
 		return Trace(ctx, ray);
 	}
 
+	Color Shade(const Ray<Dimension>& ray, const Hit<Dimension>& hit, float cone)
+	{
+		int side = 0;
+		while (side < (int)Dimension - 1 && hit.normal[side] == 0)
+			++side;
+		TraceContext ctx{ {1, 1, 1}, 0, cone, nullptr };
+		return ProcessingMaterial(ctx, ray, Intersetcion::Leaf(hit.material, hit.t, side));
+	}
+
+	template <typename Next>
+	static Color Shade(Random<Dimension>& rnd, const Ray<Dimension>& ray, const Hit<Dimension>& hit, Color color, int depth, const Next& next)
+	{
+		int side = 0;
+		while (side < (int)Dimension - 1 && hit.normal[side] == 0)
+			++side;
+		TraceContext ctx{ color, depth, 0, nullptr };
+		return Scatter(rnd, ctx, ray, Intersetcion::Leaf(hit.material, hit.t, side), [&](const TraceContext& bounce, const Ray<Dimension>& secondary) {
+			return next(secondary, bounce.color, bounce.depth);
+		});
+	}
+
+	bool Occluded(const Ray<Dimension>& ray, float tmax) const
+	{
+		Traversal walk(ray);
+		while (Advance(ray, walk, true) && walk.t < tmax)
+			if (getMaterial(walk.pos) != 0)
+				return true;
+		return false;
+	}
+
+	void OccludedN(const Ray<Dimension>* rays, const float* tmax, int count, unsigned long long* results) const
+	{
+		for (int i = 0; i < count; i += 64)
+		{
+			unsigned long long mask = 0;
+			for (int j = 0; j < 64 && i + j < count; ++j)
+				if (Occluded(rays[i + j], tmax[i + j]))
+					mask |= 1ull << j;
+			results[i / 64] = mask;
+		}
+	}
+
+	bool Intersect(const Ray<Dimension>& ray, float tmax, Hit<Dimension>& hit) const
+	{
+		Traversal walk(ray);
+		int material = getMaterial(walk.pos);
+		while (Advance(ray, walk, material == 0) && walk.t < tmax)
+		{
+			if (int m = getMaterial(walk.pos); material != m)
+			{
+				hit.point = ray.point + ray.vector * walk.t;
+				hit.voxel = walk.pos;
+				hit.normal = i_vector(0);
+				hit.normal[walk.side] = ray.vector[walk.side] > 0 ? -1 : 1;
+				hit.material = m;
+				hit.t = walk.t;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void IntersectN(const Ray<Dimension>* rays, const float* tmax, int count, const HitRecords<Dimension>& hits) const
+	{
+		Hit<Dimension> hit;
+		for (int i = 0; i < count; ++i)
+		{
+			if (!Intersect(rays[i], tmax[i], hit))
+			{
+				hit.point = rays[i].point;
+				hit.voxel = index_p(-1);
+				hit.normal = i_vector(0);
+				hit.material = -1;
+				hit.t = INFINITY;
+			}
+			hits.point[i] = hit.point;
+			hits.voxel[i] = hit.voxel;
+			hits.normal[i] = hit.normal;
+			hits.material[i] = hit.material;
+			hits.t[i] = hit.t;
+		}
+	}
+
 	int size() const
 	{
 		return 1 << Depth;
@@ -361,6 +1543,18 @@ public:
 		return data[p];
 	}
 
+	void getMaterials(const index_p* points, int* out, int count) const
+	{
+		for (int i = 0; i < count; ++i)
+			out[i] = data[points[i]];
+	}
+
+	void setMaterials(const index_p* points, const int* materials, int count)
+	{
+		for (int i = 0; i < count; ++i)
+			data[points[i]] = materials[i];
+	}
+
 	Color Trace(Ray<Dimension> ray)
 	{
 		return Trace(ray, { {1, 1, 1}, 0 });
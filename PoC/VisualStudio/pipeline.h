@@ -0,0 +1,263 @@
+#pragma once
+#include "graph.h"
+#include "base.h"
+#include "profile.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+template <typename T>
+class BoundedQueue
+{
+	std::queue<T> data;
+	size_t capacity;
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity)
+	{ }
+
+	void push(T value)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [&] { return data.size() < capacity; });
+		data.push(std::move(value));
+		not_empty.notify_one();
+	}
+
+	T pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [&] { return !data.empty(); });
+		T value = std::move(data.front());
+		data.pop();
+		not_full.notify_one();
+		return value;
+	}
+};
+
+
+class Barrier
+{
+	int count;
+	int waiting;
+	int generation;
+	std::mutex mutex;
+	std::condition_variable released;
+
+public:
+	Barrier(int count) : count(count), waiting(0), generation(0)
+	{ }
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		int current = generation;
+		if (++waiting == count)
+		{
+			waiting = 0;
+			++generation;
+			released.notify_all();
+			return;
+		}
+		released.wait(lock, [&] { return generation != current; });
+	}
+};
+
+
+template <size_t Dimension>
+struct EditList
+{
+	std::vector<IndexPoint<Dimension>> points;
+	std::vector<int> materials;
+	int tree_size;
+
+	EditList(int tree_size = 0) : tree_size(tree_size)
+	{ }
+
+	void setMaterial(const IndexPoint<Dimension>& p, int material)
+	{
+		points.push_back(p);
+		materials.push_back(material);
+	}
+
+	int size() const
+	{
+		return tree_size;
+	}
+
+	template <typename Tree>
+	void Apply(Tree& tree) const
+	{
+		tree.setMaterials(points.data(), materials.data(), (int)points.size());
+	}
+};
+
+
+struct FrameBuffer
+{
+	int index;
+	int width, height;
+	std::vector<Color> pixels;
+	std::vector<SurfaceSample> surfaces;
+
+	FrameBuffer(int width, int height) :
+		index(-1),
+		width(width), height(height),
+		pixels(width * height),
+		surfaces(width * height)
+	{ }
+
+	Color& at(int x, int y)
+	{
+		return pixels[x + y * width];
+	}
+
+	const Color& at(int x, int y) const
+	{
+		return pixels[x + y * width];
+	}
+
+	SurfaceSample& surfaceAt(int x, int y)
+	{
+		return surfaces[x + y * width];
+	}
+};
+
+
+struct StageStats
+{
+	const char* name;
+	double total;
+	double worst;
+	int frames;
+
+	void add(double time)
+	{
+		total += time;
+		worst = max(worst, time);
+		++frames;
+	}
+
+	double average() const
+	{
+		return frames ? total / frames : 0;
+	}
+};
+
+
+template <typename Tree, size_t Dimension>
+class FramePipeline
+{
+	using clock = std::chrono::steady_clock;
+
+	Tree& tree;
+	std::vector<std::unique_ptr<FrameBuffer>> buffers;
+	BoundedQueue<EditList<Dimension>> edits;
+	BoundedQueue<FrameBuffer*> free_frames;
+	BoundedQueue<FrameBuffer*> ready_frames;
+	StageStats stats[3];
+	double wall;
+	std::function<void(const EditList<Dimension>&)> applied;
+
+	static double Since(clock::time_point start)
+	{
+		return std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+public:
+	using Edit = std::function<void(int, EditList<Dimension>&)>;
+	using Render = std::function<void(int, FrameBuffer&)>;
+	using Present = std::function<void(FrameBuffer&)>;
+	using Applied = std::function<void(const EditList<Dimension>&)>;
+
+	FramePipeline(Tree& tree, int width, int height, int count = 3) :
+		tree(tree),
+		edits(1),
+		free_frames(count),
+		ready_frames(count),
+		stats{ { "edit", 0, 0, 0 }, { "trace", 0, 0, 0 }, { "output", 0, 0, 0 } },
+		wall(0)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			buffers.emplace_back(new FrameBuffer(width, height));
+			free_frames.push(buffers.back().get());
+		}
+	}
+
+	void OnApply(Applied callback)
+	{
+		applied = callback;
+	}
+
+	void Run(int frames, Edit edit, Render render, Present present)
+	{
+		clock::time_point run_start = clock::now();
+		std::thread editor([&] {
+			for (int frame = 1; frame < frames; ++frame)
+			{
+				Profiler::SetFrame(frame);
+				clock::time_point start = clock::now();
+				EditList<Dimension> list(tree.size());
+				{
+					ProfileScope scope("edit");
+					edit(frame, list);
+				}
+				stats[0].add(Since(start));
+				edits.push(std::move(list));
+			}
+		});
+
+		std::thread presenter([&] {
+			for (int frame = 0; frame < frames; ++frame)
+			{
+				FrameBuffer* buffer = ready_frames.pop();
+				Profiler::SetFrame(buffer->index);
+				clock::time_point start = clock::now();
+				present(*buffer);
+				stats[2].add(Since(start));
+				free_frames.push(buffer);
+			}
+		});
+
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			EditList<Dimension> list = frame > 0 ? edits.pop() : EditList<Dimension>();
+			FrameBuffer* buffer = free_frames.pop();
+			Profiler::SetFrame(frame);
+			clock::time_point start = clock::now();
+			{
+				ProfileScope scope("apply");
+				list.Apply(tree);
+				if (applied)
+					applied(list);
+			}
+			buffer->index = frame;
+			render(frame, *buffer);
+			stats[1].add(Since(start));
+			ready_frames.push(buffer);
+		}
+
+		editor.join();
+		presenter.join();
+		wall += Since(run_start);
+	}
+
+	void Report(std::ostream& out) const
+	{
+		for (const StageStats& stage : stats)
+			out << stage.name << ": avg " << stage.average() << "s, worst " << stage.worst << "s, frames " << stage.frames << std::endl;
+		if (stats[1].frames)
+			out << "frame: " << wall / stats[1].frames << "s" << std::endl;
+	}
+};
@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+struct ProfileEvent
+{
+	const char* name;
+	long long start, end;
+	int frame;
+	int thread;
+};
+
+
+class Profiler
+{
+	using clock = std::chrono::steady_clock;
+
+public:
+	static constexpr size_t Capacity = 1 << 16;
+
+private:
+	struct ThreadBuffer
+	{
+		int thread;
+		std::vector<ProfileEvent> events;
+		size_t written;
+		std::mutex mutex;
+
+		void push(const ProfileEvent& event)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (events.size() < Capacity)
+				events.push_back(event);
+			else
+				events[written % Capacity] = event;
+			++written;
+		}
+	};
+
+	struct Lease
+	{
+		ThreadBuffer* buffer = nullptr;
+		int frame = -1;
+
+		~Lease()
+		{
+			if (buffer)
+				Instance().Release(buffer);
+		}
+	};
+
+	clock::time_point epoch;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+	std::vector<ThreadBuffer*> idle;
+
+	Profiler() : epoch(clock::now())
+	{ }
+
+	static Lease& Local()
+	{
+		thread_local Lease lease;
+		return lease;
+	}
+
+	ThreadBuffer* Acquire()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!idle.empty())
+		{
+			ThreadBuffer* buffer = idle.back();
+			idle.pop_back();
+			return buffer;
+		}
+		buffers.emplace_back(new ThreadBuffer{ (int)buffers.size(), {}, 0 });
+		return buffers.back().get();
+	}
+
+	void Release(ThreadBuffer* buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.push_back(buffer);
+	}
+
+	long long Ticks(clock::time_point time) const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch).count();
+	}
+
+	std::vector<ProfileEvent> Collect()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<ProfileEvent> events;
+		for (const std::unique_ptr<ThreadBuffer>& buffer : buffers)
+		{
+			std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+			events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+		}
+		std::sort(events.begin(), events.end(), [](const ProfileEvent& a, const ProfileEvent& b) { return a.start < b.start; });
+		return events;
+	}
+
+public:
+	static Profiler& Instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	static void SetFrame(int frame)
+	{
+		Local().frame = frame;
+	}
+
+	static int Frame()
+	{
+		return Local().frame;
+	}
+
+	void Record(const char* name, clock::time_point start, clock::time_point end, int frame)
+	{
+		Lease& lease = Local();
+		if (!lease.buffer)
+			lease.buffer = Acquire();
+		lease.buffer->push({ name, Ticks(start), Ticks(end), frame, lease.buffer->thread });
+	}
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const std::unique_ptr<ThreadBuffer>& buffer : buffers)
+		{
+			std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+			buffer->events.clear();
+			buffer->written = 0;
+		}
+	}
+
+	void WriteTrace(std::ostream& out)
+	{
+		std::vector<ProfileEvent> events = Collect();
+		size_t threads;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			threads = buffers.size();
+		}
+		out << "{\"traceEvents\":[";
+		const char* separator = "\n";
+		for (size_t thread = 0; thread < threads; ++thread)
+		{
+			out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread
+				<< ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+			separator = ",\n";
+		}
+		out << std::fixed << std::setprecision(3);
+		for (const ProfileEvent& event : events)
+		{
+			out << separator << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+				<< ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << (event.end - event.start) / 1000.0
+				<< ",\"args\":{\"frame\":" << event.frame << "}}";
+			separator = ",\n";
+		}
+		out << "\n]}\n";
+	}
+
+	void Summary(std::ostream& out)
+	{
+		std::vector<ProfileEvent> events = Collect();
+		std::vector<std::string> stages;
+		std::map<int, std::map<std::string, double>> frames;
+		std::map<int, std::pair<long long, long long>> spans;
+		for (const ProfileEvent& event : events)
+		{
+			if (std::find(stages.begin(), stages.end(), event.name) == stages.end())
+				stages.push_back(event.name);
+			frames[event.frame][event.name] += (event.end - event.start) / 1e6;
+			auto span = spans.emplace(event.frame, std::make_pair(event.start, event.end)).first;
+			span->second.first = (std::min)(span->second.first, event.start);
+			span->second.second = (std::max)(span->second.second, event.end);
+		}
+
+		out << "stage time per frame, ms" << std::endl;
+		out << std::setw(8) << "frame";
+		for (const std::string& stage : stages)
+			out << std::setw(14) << stage;
+		out << std::setw(14) << "wall" << std::endl;
+		out << std::fixed << std::setprecision(2);
+		for (const auto& frame : frames)
+		{
+			out << std::setw(8) << (frame.first < 0 ? std::string("-") : std::to_string(frame.first));
+			for (const std::string& stage : stages)
+			{
+				auto time = frame.second.find(stage);
+				out << std::setw(14) << (time != frame.second.end() ? time->second : 0.0);
+			}
+			const std::pair<long long, long long>& span = spans[frame.first];
+			out << std::setw(14) << (span.second - span.first) / 1e6 << std::endl;
+		}
+		out << std::defaultfloat;
+	}
+};
+
+
+class ProfileScope
+{
+	using clock = std::chrono::steady_clock;
+
+	const char* name;
+	int frame;
+	clock::time_point start;
+
+public:
+	ProfileScope(const char* name, int frame = Profiler::Frame()) :
+		name(name),
+		frame(frame),
+		start(clock::now())
+	{ }
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+	~ProfileScope()
+	{
+		Profiler::Instance().Record(name, start, clock::now(), frame);
+	}
+};
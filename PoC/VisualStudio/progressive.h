@@ -0,0 +1,151 @@
+#pragma once
+#include "graph.h"
+#include "base.h"
+#include "octotree.h"
+#include "pipeline.h"
+#include "profile.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+
+template <typename Tree, size_t Dimension>
+class ProgressiveRenderer
+{
+	int width, height;
+	int samples;
+	float cone;
+	std::vector<Color> sum;
+	std::vector<float> moment;
+	std::vector<int> count;
+	std::vector<float> priority;
+
+	static float Luminance(const Color& color)
+	{
+		return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+	}
+
+	template <typename CameraFn>
+	void Sample(Tree& tree, const CameraFn& camera, int x, int y)
+	{
+		int pixel = x + y * width;
+		Color color = tree.Trace(camera(x, y, count[pixel]), cone);
+		float lum = Luminance(color);
+		sum[pixel] = sum[pixel] + color;
+		moment[pixel] += lum * lum;
+		++count[pixel];
+	}
+
+	void Fill(FrameBuffer& out, int block) const
+	{
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+			{
+				int source = x - x % block + (y - y % block) * width;
+				int pixel = count[x + y * width] > 0 ? x + y * width : source;
+				out.at(x, y) = sum[pixel] / (float)count[pixel];
+			}
+	}
+
+	float UpdatePriority()
+	{
+		float worst = 0;
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+			{
+				int pixel = x + y * width;
+				float mean = Luminance(sum[pixel]) / count[pixel];
+				float error;
+				if (count[pixel] > 1)
+					error = (std::max)(0.0f, moment[pixel] / count[pixel] - mean * mean) / count[pixel];
+				else
+				{
+					error = 0;
+					int neighbors[][2] = { { x - 1, y }, { x + 1, y }, { x, y - 1 }, { x, y + 1 } };
+					for (const int* n : neighbors)
+						if (n[0] >= 0 && n[0] < width && n[1] >= 0 && n[1] < height)
+						{
+							int other = n[0] + n[1] * width;
+							float diff = Luminance(sum[other]) / count[other] - mean;
+							error = (std::max)(error, diff * diff);
+						}
+				}
+				priority[pixel] = count[pixel] < samples ? error : 0;
+				worst = (std::max)(worst, priority[pixel]);
+			}
+		return worst;
+	}
+
+public:
+	static constexpr int BlockSize = 8;
+	static constexpr int AdaptiveRounds = 4;
+
+	using Camera = std::function<Ray<Dimension>(int, int, int)>;
+	using Publish = std::function<void(FrameBuffer&)>;
+
+	ProgressiveRenderer(int width, int height, int samples, float cone) :
+		width(width), height(height),
+		samples(samples),
+		cone(cone),
+		sum(width * height),
+		moment(width * height),
+		count(width * height),
+		priority(width * height)
+	{ }
+
+	void Render(Tree& tree, const Camera& camera, FrameBuffer& out, const Publish& publish)
+	{
+		std::fill(sum.begin(), sum.end(), Color{ 0, 0, 0 });
+		std::fill(moment.begin(), moment.end(), 0.0f);
+		std::fill(count.begin(), count.end(), 0);
+
+		for (int block = BlockSize; block >= 1; block /= 2)
+		{
+			{
+				ProfileScope scope("trace");
+				for (int y = 0; y < height; y += block)
+					for (int x = 0; x < width; x += block)
+						if (block == BlockSize || x % (block * 2) != 0 || y % (block * 2) != 0)
+							Sample(tree, camera, x, y);
+			}
+			Fill(out, block);
+			publish(out);
+		}
+
+		float threshold = UpdatePriority() / 4;
+		for (int round = 0; round < AdaptiveRounds && threshold > 0; ++round, threshold /= 4)
+		{
+			{
+				ProfileScope scope("trace");
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+						if (priority[x + y * width] >= threshold)
+							Sample(tree, camera, x, y);
+			}
+			Fill(out, 1);
+			publish(out);
+			UpdatePriority();
+		}
+
+		for (bool pending = true; pending;)
+		{
+			pending = false;
+			{
+				ProfileScope scope("trace");
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+						if (count[x + y * width] < samples)
+						{
+							Sample(tree, camera, x, y);
+							pending = true;
+						}
+			}
+			if (pending)
+			{
+				Fill(out, 1);
+				publish(out);
+			}
+		}
+	}
+};
@@ -0,0 +1,321 @@
+#pragma once
+#include "graph.h"
+#include "base.h"
+#include "random.h"
+#include "octotree.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+
+template <size_t Dimension>
+struct RigidTransform
+{
+	fVector<Dimension> offset;
+	int axis[Dimension];
+	int sign[Dimension];
+
+	static RigidTransform Translation(const fVector<Dimension>& offset)
+	{
+		RigidTransform result;
+		result.offset = offset;
+		for (int i = 0; i < Dimension; ++i)
+		{
+			result.axis[i] = i;
+			result.sign[i] = 1;
+		}
+		return result;
+	}
+
+	fPoint<Dimension> ToLocal(const fPoint<Dimension>& p) const
+	{
+		fPoint<Dimension> result;
+		for (int i = 0; i < Dimension; ++i)
+			result[i] = sign[i] * (p[axis[i]] - offset[axis[i]]);
+		return result;
+	}
+
+	fVector<Dimension> ToLocal(const fVector<Dimension>& v) const
+	{
+		fVector<Dimension> result;
+		for (int i = 0; i < Dimension; ++i)
+			result[i] = sign[i] * v[axis[i]];
+		return result;
+	}
+
+	iVector<Dimension> ToWorld(const iVector<Dimension>& v) const
+	{
+		iVector<Dimension> result;
+		for (int i = 0; i < Dimension; ++i)
+			result[axis[i]] = sign[i] * v[i];
+		return result;
+	}
+};
+
+
+template <typename Tree, size_t Dimension>
+class InstancedScene
+{
+	using f_point = fPoint<Dimension>;
+	using f_vector = fVector<Dimension>;
+	using i_vector = iVector<Dimension>;
+
+	struct Bounds
+	{
+		f_point lo, hi;
+
+		void add(const Bounds& b)
+		{
+			for (int i = 0; i < Dimension; ++i)
+			{
+				lo[i] = (std::min)(lo[i], b.lo[i]);
+				hi[i] = (std::max)(hi[i], b.hi[i]);
+			}
+		}
+
+		bool Clip(const Ray<Dimension>& ray, float& t0, float& t1, int& side) const
+		{
+			side = 0;
+			for (int i = 0; i < Dimension; ++i)
+			{
+				float inv = 1 / ray.vector[i];
+				float a = (lo[i] - ray.point[i]) * inv;
+				float b = (hi[i] - ray.point[i]) * inv;
+				if (a > b)
+					std::swap(a, b);
+				if (a > t0)
+				{
+					t0 = a;
+					side = i;
+				}
+				t1 = (std::min)(t1, b);
+				if (t0 > t1)
+					return false;
+			}
+			return true;
+		}
+	};
+
+	struct Instance
+	{
+		const Tree* tree;
+		RigidTransform<Dimension> transform;
+		Bounds local;
+	};
+
+	struct BvhNode
+	{
+		Bounds bounds;
+		int first, count;
+		int right;
+	};
+
+	std::vector<Instance> instances;
+	std::vector<Bounds> bounds;
+	std::vector<int> order;
+	std::vector<BvhNode> nodes;
+	std::map<const Tree*, Bounds> occupied;
+	Random<Dimension> rnd;
+
+	Bounds LocalBounds(const Tree& tree)
+	{
+		auto found = occupied.find(&tree);
+		if (found != occupied.end())
+			return found->second;
+		IndexPoint<Dimension> lo, hi;
+		Bounds result;
+		bool empty = !tree.OccupiedBounds(lo, hi);
+		for (int i = 0; i < Dimension; ++i)
+		{
+			result.lo[i] = empty ? 0.0f : (float)lo[i];
+			result.hi[i] = empty ? 0.0f : (float)hi[i];
+		}
+		occupied[&tree] = result;
+		return result;
+	}
+
+	Bounds InstanceBounds(const Instance& instance) const
+	{
+		Bounds result;
+		for (int i = 0; i < Dimension; ++i)
+		{
+			int world = instance.transform.axis[i];
+			float a = instance.transform.offset[world] + instance.transform.sign[i] * instance.local.lo[i];
+			float b = instance.transform.offset[world] + instance.transform.sign[i] * instance.local.hi[i];
+			result.lo[world] = (std::min)(a, b);
+			result.hi[world] = (std::max)(a, b);
+		}
+		return result;
+	}
+
+	Bounds RangeBounds(int first, int count) const
+	{
+		Bounds result = bounds[order[first]];
+		for (int i = first + 1; i < first + count; ++i)
+			result.add(bounds[order[i]]);
+		return result;
+	}
+
+	int BuildNode(int first, int count)
+	{
+		int index = (int)nodes.size();
+		nodes.push_back({ RangeBounds(first, count), first, count, -1 });
+		if (count <= 2)
+			return index;
+
+		const Bounds& box = nodes[index].bounds;
+		int axis = 0;
+		for (int i = 1; i < Dimension; ++i)
+			if (box.hi[i] - box.lo[i] > box.hi[axis] - box.lo[axis])
+				axis = i;
+		int* begin = order.data() + first;
+		std::nth_element(begin, begin + count / 2, begin + count, [&](int a, int b) {
+			return bounds[a].lo[axis] + bounds[a].hi[axis] < bounds[b].lo[axis] + bounds[b].hi[axis];
+		});
+
+		nodes[index].count = 0;
+		BuildNode(first, count / 2);
+		int right = BuildNode(first + count / 2, count - count / 2);
+		nodes[index].right = right;
+		return index;
+	}
+
+	bool IntersectInstance(const Instance& instance, const Ray<Dimension>& ray, float tmax, Hit<Dimension>& hit) const
+	{
+		const RigidTransform<Dimension>& transform = instance.transform;
+		Ray<Dimension> local{ transform.ToLocal(ray.point), transform.ToLocal(ray.vector) };
+		const Bounds& box = instance.local;
+		float t0 = 0, t1 = tmax;
+		int side;
+		if (!box.Clip(local, t0, t1, side))
+			return false;
+
+		Ray<Dimension> inner{ local.point + local.vector * t0, local.vector };
+		IndexPoint<Dimension> voxel;
+		for (int i = 0; i < Dimension; ++i)
+			voxel[i] = (std::min)((std::max)((int)inner.point[i], (int)box.lo[i]), (int)box.hi[i] - 1);
+		int material = instance.tree->getMaterial(voxel);
+		if (t0 > 0 && material != 0)
+		{
+			hit.voxel = voxel;
+			hit.normal = i_vector(0);
+			hit.normal[side] = local.vector[side] > 0 ? -1 : 1;
+			hit.material = material;
+			hit.t = t0;
+		}
+		else if (!instance.tree->Intersect(inner, t1 - t0, hit))
+			return false;
+		else
+			hit.t += t0;
+
+		hit.point = ray.point + ray.vector * hit.t;
+		hit.normal = transform.ToWorld(hit.normal);
+		return true;
+	}
+
+	Color Trace(const Ray<Dimension>& ray, Color color, int depth)
+	{
+		Hit<Dimension> hit;
+		if (!Intersect(ray, INFINITY, hit))
+			return { 0, 0, 0 };
+		return Tree::Shade(rnd, ray, hit, color, depth, [this](const Ray<Dimension>& secondary, Color weight, int bounce) {
+			return Trace(secondary, weight, bounce);
+		});
+	}
+
+public:
+	int Add(const Tree& tree, const RigidTransform<Dimension>& transform)
+	{
+		instances.push_back({ &tree, transform, LocalBounds(tree) });
+		bounds.push_back(InstanceBounds(instances.back()));
+		return (int)instances.size() - 1;
+	}
+
+	void Move(int instance, const RigidTransform<Dimension>& transform)
+	{
+		instances[instance].transform = transform;
+		bounds[instance] = InstanceBounds(instances[instance]);
+	}
+
+	void Refresh(const Tree& tree)
+	{
+		occupied.erase(&tree);
+		Bounds local = LocalBounds(tree);
+		for (int i = 0; i < (int)instances.size(); ++i)
+			if (instances[i].tree == &tree)
+			{
+				instances[i].local = local;
+				bounds[i] = InstanceBounds(instances[i]);
+			}
+		Refit();
+	}
+
+	void Build()
+	{
+		order.resize(instances.size());
+		for (int i = 0; i < (int)order.size(); ++i)
+			order[i] = i;
+		nodes.clear();
+		if (!instances.empty())
+			BuildNode(0, (int)instances.size());
+	}
+
+	void Refit()
+	{
+		for (int i = (int)nodes.size() - 1; i >= 0; --i)
+		{
+			BvhNode& node = nodes[i];
+			if (node.count > 0)
+				node.bounds = RangeBounds(node.first, node.count);
+			else
+			{
+				node.bounds = nodes[i + 1].bounds;
+				node.bounds.add(nodes[node.right].bounds);
+			}
+		}
+	}
+
+	bool Intersect(const Ray<Dimension>& ray, float tmax, Hit<Dimension>& hit, int* instance = nullptr) const
+	{
+		if (nodes.empty())
+			return false;
+		bool found = false;
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BvhNode& node = nodes[stack[--top]];
+			float t0 = 0, t1 = tmax;
+			int side;
+			if (!node.bounds.Clip(ray, t0, t1, side))
+				continue;
+			if (node.count == 0)
+			{
+				stack[top++] = node.right;
+				stack[top++] = (int)(&node - nodes.data()) + 1;
+				continue;
+			}
+			for (int i = node.first; i < node.first + node.count; ++i)
+				if (IntersectInstance(instances[order[i]], ray, tmax, hit))
+				{
+					tmax = hit.t;
+					found = true;
+					if (instance)
+						*instance = order[i];
+				}
+		}
+		return found;
+	}
+
+	Color Trace(const Ray<Dimension>& ray)
+	{
+		return Trace(ray, { 1, 1, 1 }, 0);
+	}
+
+	int size() const
+	{
+		return (int)instances.size();
+	}
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include "graph.h"
+#include "base.h"
+#include "octotree.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+#include <vector>
+
+
+struct VoxModel
+{
+	int size[3];
+	std::vector<unsigned char> voxels;
+	std::array<Color, 256> palette;
+
+	int at(const IndexPoint<3>& p) const
+	{
+		for (int d = 0; d < 3; ++d)
+			if (p[d] < 0 || p[d] >= size[d])
+				return 0;
+		return voxels[p[0] + size[0] * (p[1] + size[1] * p[2])];
+	}
+};
+
+
+inline int ReadVoxInt(std::istream& in)
+{
+	unsigned char bytes[4];
+	if (!in.read((char*)bytes, 4))
+		throw std::runtime_error("unexpected end of vox stream");
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+}
+
+
+inline VoxModel LoadVox(std::istream& in)
+{
+	char id[4];
+	if (!in.read(id, 4) || std::memcmp(id, "VOX ", 4) != 0)
+		throw std::runtime_error("not a vox stream");
+	ReadVoxInt(in);
+
+	VoxModel model{ { 0, 0, 0 } };
+	model.palette.fill({ 0.8f, 0.8f, 0.8f });
+	model.palette[0] = { 0, 0, 0 };
+	bool has_size = false, has_voxels = false;
+
+	while (in.read(id, 4))
+	{
+		int content = ReadVoxInt(in);
+		int children = ReadVoxInt(in);
+		if (std::memcmp(id, "MAIN", 4) == 0)
+			continue;
+
+		if (std::memcmp(id, "SIZE", 4) == 0 && !has_size)
+		{
+			for (int d = 0; d < 3; ++d)
+				model.size[d] = ReadVoxInt(in);
+			model.voxels.assign((size_t)model.size[0] * model.size[1] * model.size[2], 0);
+			has_size = true;
+			content -= 12;
+		}
+		else if (std::memcmp(id, "XYZI", 4) == 0 && has_size && !has_voxels)
+		{
+			int count = ReadVoxInt(in);
+			std::vector<unsigned char> data((size_t)count * 4);
+			if (!in.read((char*)data.data(), data.size()))
+				throw std::runtime_error("unexpected end of vox stream");
+			for (int i = 0; i < count; ++i)
+			{
+				const unsigned char* v = &data[i * 4];
+				if (v[0] < model.size[0] && v[1] < model.size[1] && v[2] < model.size[2])
+					model.voxels[v[0] + model.size[0] * (v[1] + model.size[1] * v[2])] = v[3];
+			}
+			has_voxels = true;
+			content -= 4 + count * 4;
+		}
+		else if (std::memcmp(id, "RGBA", 4) == 0)
+		{
+			unsigned char rgba[256 * 4];
+			if (!in.read((char*)rgba, sizeof(rgba)))
+				throw std::runtime_error("unexpected end of vox stream");
+			for (int i = 0; i < 255; ++i)
+				model.palette[i + 1] = { rgba[i * 4] / 255.0f, rgba[i * 4 + 1] / 255.0f, rgba[i * 4 + 2] / 255.0f };
+			content -= sizeof(rgba);
+		}
+		in.ignore((std::streamsize)content + children);
+	}
+
+	if (!has_voxels)
+		throw std::runtime_error("vox stream has no voxel data");
+	return model;
+}
+
+
+inline std::array<int, 256> AppendPalette(const VoxModel& model, std::vector<Material>& table)
+{
+	std::array<bool, 256> used{};
+	for (unsigned char voxel : model.voxels)
+		used[voxel] = true;
+
+	std::array<int, 256> result{};
+	for (int i = 1; i < 256; ++i)
+	{
+		if (!used[i])
+			continue;
+		const Color& color = model.palette[i];
+		auto match = std::find_if(table.begin() + 1, table.end(), [&](const Material& m) {
+			return m.color.r == color.r && m.color.g == color.g && m.color.b == color.b
+				&& m.reflection == 0 && m.transparency == 0 && m.refraction == 0 && !m.light;
+		});
+		result[i] = (int)(match - table.begin());
+		if (match == table.end())
+			table.push_back({ color, 0, 0, 0, false });
+	}
+	return result;
+}